@@ -23,6 +23,10 @@ public:
 int main(int argc, char* argv)
 {
     // 初始化工作
+    // 线程名每个线程设置一次, 之后这个线程的日志都会带上, PatternFormatter用%N输出
+    log::setThreadName("main");
+    // 写日志时只读TSC计数器, 换算成纳秒放到后台线程; 配合Formatter::Precision::Nanoseconds可以区分同一毫秒内的日志
+    // log::Clock::setSource(log::ClockSource::Tsc);
     log::AppenderRegistry::instance().addAppenders({"console", "file"});
     if (const auto& appender = log::AppenderRegistry::instance().get("file")) {
         const auto fileAppender = std::dynamic_pointer_cast<log::FileAppender>(appender);
@@ -30,6 +34,14 @@ int main(int argc, char* argv)
         fileAppender->setBasePath("log");
         // 设置输出到文件的日志等级
         fileAppender->setLevel(log::Level::Info);
+        // 开启缓冲, 缓冲区满、到了刷新间隔或者写入Error及以上级别的日志时才写文件
+        fileAppender->setBufferSize(64 * 1024);
+        fileAppender->setFlushInterval(std::chrono::milliseconds(500));
+        // 分割出来的旧文件在后台压缩成.gz, 最多保留30个归档
+        fileAppender->setCompression(true);
+        fileAppender->setRetention(30);
+        // 自定义格式, 格式串只在构造时解析一次
+        // fileAppender->setFormatter(std::make_shared<log::PatternFormatter>("%Y-%m-%d %H:%M:%S.%e [%l] [%t] %s:%# %v"));
         // 设置文件分割策略回调, 内置分割策略在resetFile函数里面调用。
         // fileAppender->setFileSplitPolicy([](LogEvent::Ptr, FileAppender&) {return "log_file_name";});
         //
@@ -37,10 +49,30 @@ int main(int argc, char* argv)
     if (const auto& appender = log::AppenderRegistry::instance().get("console")) {
         appender->setLevel(log::Level::Debug);
     }
+    // 崩溃时把缓冲区里的日志、一行FATAL和调用栈写到日志文件, 开了缓冲也不会丢掉崩溃前的日志
+    log::CrashHandler::install();
+    // 固定大小的环形文件: addAppenders({"ring"})后调用RingFileAppender::open("log/qlog.ring", 4 * 1024 * 1024),
+    // 崩溃后用RingFileAppender::read("log/qlog.ring")按顺序读出日志。
+    // 二进制日志: addAppenders({"binary"})后和file一样设置路径, 生成的.qlb文件用qlog_decode转成文本。
+    // 按key分文件: addAppenders({"routing"})后set_key("tenant-a")的日志写到log/tenant-a/下, 每个key单独分割,
+    // setMaxOpenFiles限制同时打开的文件数, setFileInitializer设置每个key的FileAppender。
+    // 开启异步模式, 格式化和写文件在后台线程完成, 程序退出时会写完队列中剩余的日志。
+    // 磁盘卡住时排队的日志最多占用16MB, 控制台积压时丢弃较早的非Error日志而不是阻塞业务线程, 丢弃数量会定期写一条Warning
+    log::AsyncWorker::instance().setMemoryBudget(16 * 1024 * 1024);
+    if (const auto& appender = log::AppenderRegistry::instance().get("console")) {
+        appender->setOverflowPolicy(log::OverflowPolicy::DropOldest);
+    }
+    // 文件只写Info及以上, 被过滤的Debug日志每个线程保留最近1000条在内存里, 写Error时先把它们写到文件
+    log::AppenderRegistry::instance().enableBacktrace(1000);
+    // 每分钟把各appender的计数和耗时分布写一条日志, 也可以随时用Metrics::instance().snapshot()读取
+    log::Metrics::instance().setReportInterval(std::chrono::minutes(1));
+    log::AsyncWorker::instance().start();
     log::log(log::Level::Debug) << "invisible message in file";
     log::log(log::Level::Error) << "visible message in file";
 
     log::Logger(__FILE__, __LINE__, log::Level::Debug).log(std::format("{}, {}, {:.2f}, {}\n", 1, 2, 4.1, "Debug All"));
+    // 编译期检查格式串，直接格式化到日志缓冲区
+    log::console().fmt("{}, {}, {:.2f}, {}", 1, 2, 4.1, "fmt All");
     // 没必要的换行
     log::Logger(__FILE__, __LINE__) << "Info All";
 
@@ -54,7 +86,18 @@ int main(int argc, char* argv)
     const A a;
      log::log(log::Level::Info) << "log class A: " << a;
 
-    // 多线程测试 console
+    // 宏会先判断级别, 被过滤的日志不会构造Logger也不会求值参数
+    QLOG_INFO("macro info %d", 42);
+    QLOG(log::Level::Warning) << "macro stream " << a;
+    // 按调用位置限流, 热循环里出错也不会刷屏
+    for (int i = 0; i < 100; ++i) {
+        QLOG_EVERY_N(log::Level::Warning, 50).log("retry %d", i);
+    }
+
+    // 结构化字段, 配合JsonFormatter每条日志输出一行JSON
+    log::console().with("user_id", 42).with("latency_us", 137) << "request done";
+
+    // 多线程测试 console, 这里包含了创建线程的时间; 单独测量日志的延迟和吞吐量请用qlog_bench
     // console << "hello";
     const auto startTm = log::console().time();
      log::console() << "multi thread test:";
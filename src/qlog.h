@@ -22,6 +22,30 @@
 #include <chrono>
 #include <format>
 #include <source_location>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <future>
+#include <utility>
+#include <memory>
+#include <cstring>
+#include <tuple>
+#include <algorithm>
+#include <vector>
+#include <iterator>
+#include <charconv>
+#include <typeinfo>
+#include <ctime>
+#include <climits>
+#include <bit>
+#include <cerrno>
+#include <cstdlib>
+#include <cmath>
+#include <cctype>
+#include <unordered_map>
+#include <array>
+#include <optional>
+#include <set>
 
 #ifdef _HAS_STD_BYTE
 #undef _HAS_STD_BYTE
@@ -30,6 +54,51 @@
 
 #if defined(WIN32) || defined(_WIN32) || defined(Q_OS_WIN32)
 #define localtime_r(_Time, _Tm) localtime_s(_Tm, _Time)
+#define gmtime_r(_Time, _Tm) gmtime_s(_Tm, _Time)
+#define QLOG_WINDOWS 1
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <pthread.h>
+#endif
+#ifndef QLOG_WINDOWS
+#include <csignal>
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define QLOG_HAS_BACKTRACE 1
+#endif
+#endif
+// TSC时间戳
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define QLOG_HAS_TSC 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+#endif
+
+// 压缩归档日志时使用zlib, 否则使用内置的简单gzip压缩(压缩率低一些, 不需要额外依赖)
+#ifndef QLOG_USE_ZLIB
+#define QLOG_USE_ZLIB 0
+#endif
+#if QLOG_USE_ZLIB
+#include <zlib.h>
 #endif
 
 #ifdef USE_QT
@@ -66,6 +135,42 @@ namespace ray::log
 #ifndef DISABLE_CONSOLE
 #define DISABLE_CONSOLE 0
 #endif
+
+// 是否开启延迟格式化, 开启后log("%d", n)只拷贝参数，snprintf在写日志时才执行
+#ifndef QLOG_DEFERRED_FORMAT
+#define QLOG_DEFERRED_FORMAT 1
+#endif
+
+// 延迟格式化时每条日志用于保存格式串和参数的空间，放不下时退回到立即格式化
+#ifndef QLOG_DEFERRED_ARGS_SIZE
+#define QLOG_DEFERRED_ARGS_SIZE 256
+#endif
+
+// 每条日志用于保存结构化字段(Logger::with)的空间，放不下的字段会被丢弃
+#ifndef QLOG_FIELDS_SIZE
+#define QLOG_FIELDS_SIZE 256
+#endif
+
+// 异步模式下排队中的日志最多占用的内存, 按每条日志实际占用计算, 超出后按appender的OverflowPolicy处理。0为不限制
+#ifndef QLOG_ASYNC_MEMORY_BUDGET
+#define QLOG_ASYNC_MEMORY_BUDGET (64 * 1024 * 1024)
+#endif
+
+// 日志内容内联缓冲区大小, 超出后才会申请堆内存
+#ifndef QLOG_INLINE_MESSAGE_SIZE
+#define QLOG_INLINE_MESSAGE_SIZE 256
+#endif
+
+// 编译期日志级别，低于这个级别的QLOG_XXX宏会被直接移除，参数也不会被求值。
+#define QLOG_LEVEL_DEBUG   1
+#define QLOG_LEVEL_INFO    2
+#define QLOG_LEVEL_WARNING 3
+#define QLOG_LEVEL_ERROR   4
+#define QLOG_LEVEL_FATAL   5
+#define QLOG_LEVEL_OFF     6
+#ifndef QLOG_ACTIVE_LEVEL
+#define QLOG_ACTIVE_LEVEL QLOG_LEVEL_DEBUG
+#endif
 // clang-format on
     class Event;
 
@@ -80,17 +185,125 @@ namespace ray::log
         Fatal
     };
 
-    // 日志内容流
-    class Stream : public std::ostringstream
+    // 一组appender, 每个appender名在AppenderRegistry里对应一位，0表示使用DEFAULT_APPENDERS
+    using AppenderMask = uint64_t;
+
+    // 异步队列满了或者超出内存预算时的处理方式, 一条日志写到多个appender时取最严格的(值最大的)
+    enum class OverflowPolicy : uint8_t
+    {
+        // 丢弃新的日志
+        DropNewest,
+        // 丢弃队列中较早的非Error日志, 腾不出位置时丢弃新的非Error日志, Error及以上等待
+        DropOldest,
+        // 不排队, 退回到同步模式在调用线程直接写。不会占用额外内存, 但调用线程要等appender写完,
+        // 而且这条日志会先于队列中还没写的日志写出
+        Synchronous,
+        // 等待后台线程腾出位置
+        Block
+    };
+
+    // 日志内容流, 内容先写到内联缓冲区，超出QLOG_INLINE_MESSAGE_SIZE后才转到堆上。
+    class Stream : public std::ostream
     {
     public:
         using Ptr = std::shared_ptr<Stream>;
+        Stream()
+            : std::ostream(&_buffer)
+        { }
+        Stream(const Stream&) = delete;
+        Stream& operator=(const Stream&) = delete;
+
+        std::string str() const { return std::string(view()); }
+        std::string_view view() const { return _buffer.view(); }
+        size_t size() const { return _buffer.view().size(); }
+        void append(std::string_view str) { _buffer.sputn(str.data(), static_cast<std::streamsize>(str.size())); }
+        // 清空内容，复用时调用
+        void reset();
 #ifdef USE_QT
         // Stream& operator<<(const QString& str) {
         //  *this << str.toStdString();
         //  return *this;
         // }
 #endif
+    private:
+        class Buffer : public std::streambuf
+        {
+        public:
+            Buffer() { setp(_inline, _inline + sizeof(_inline)); }
+            std::string_view view() const;
+            void reset();
+
+        protected:
+            int_type overflow(int_type ch) override;
+            std::streamsize xsputn(const char* s, std::streamsize n) override;
+
+        private:
+            // 内联缓冲区放不下了，转到堆上
+            void spill();
+
+        private:
+            char _inline[QLOG_INLINE_MESSAGE_SIZE];
+            std::string _heap;
+            bool _spilled = false;
+        };
+        Buffer _buffer;
+    };
+
+    // 对象池, 每个线程有自己的空闲链表，其他线程归还的对象放到无锁链表里，由所属线程批量取回。
+    // 线程退出后它的池会被新线程接管，所以池的数量不会超过同时存在的线程数。对象从不析构，只会被复用。
+    template <typename T>
+    class ObjectPool
+    {
+    public:
+        static T* acquire();
+        static void release(T* object);
+
+    private:
+        struct Node : T
+        {
+            Node* next = nullptr;
+            ObjectPool* owner = nullptr;
+        };
+        // 线程退出时把池交出去
+        struct Guard
+        {
+            ~Guard();
+        };
+        static ObjectPool* local();
+        static std::mutex& orphanMutex();
+        static std::vector<ObjectPool*>& orphans();
+
+    private:
+        // 只有所属线程访问
+        Node* _free = nullptr;
+        // 其他线程归还的对象
+        std::atomic<Node*> _remote{nullptr};
+        inline static thread_local ObjectPool* _local = nullptr;
+    };
+
+    // 从ObjectPool分配内存的分配器, 给std::shared_ptr的控制块使用
+    template <typename T>
+    class PoolAllocator
+    {
+    public:
+        using value_type = T;
+        PoolAllocator() = default;
+        template <typename U>
+        PoolAllocator(const PoolAllocator<U>&)
+        { }
+        T* allocate(size_t n);
+        void deallocate(T* p, size_t n);
+        template <typename U>
+        bool operator==(const PoolAllocator<U>&) const
+        {
+            return true;
+        }
+
+    private:
+        struct Storage
+        {
+            alignas(T) std::byte data[sizeof(T)];
+        };
     };
 
     // 工具类
@@ -99,20 +312,210 @@ namespace ray::log
     public:
         template <typename... Args>
         static std::string string_format(const char* format, Args... args);
+        // 格式化后追加到out, 短内容不会申请内存
+        template <typename... Args>
+        static void string_format_to(std::string& out, const char* format, Args... args);
         // 将leve转为字符串
         inline static std::string levelToString(Level level);
         // 通过文件路径分割出文件名
-        static std::string getFilename(const std::string& filepath);
+        static std::string_view getFilename(std::string_view filepath);
+    };
+
+    // 当前线程的系统线程ID(Linux上是gettid, 和top、perf里的一致), 每个线程只取一次
+    uint32_t currentThreadId();
+    // 给当前线程起名, 之后这个线程的日志都带上这个名字; Linux上同时设置系统线程名(最长15个字符)
+    void setThreadName(std::string_view name);
+    // 当前线程的名字, 没有设置时为空
+    std::string_view currentThreadName();
+
+    // 延迟格式化的参数。调用线程只把格式串和参数拷贝进固定大小的缓冲区，
+    // 真正的snprintf在写日志的线程执行(异步模式下就是后台线程)。
+    // 只支持数值、枚举、指针和字符串，其他类型会退回到立即格式化。
+    class DeferredArgs
+    {
+    public:
+        using RenderMethod = void (*)(const std::byte* data, std::string& out);
+
+        template <typename... Args>
+        static constexpr bool supported();
+        // 拷贝格式串和参数，放不下时返回false
+        template <typename... Args>
+        bool capture(const char* format, const Args&... args);
+        // 格式化并追加到out
+        void render(std::string& out) const;
+        bool empty() const { return _render == nullptr; }
+        void clear()
+        {
+            _render = nullptr;
+            _rendered = false;
+        }
+        // 已经格式化到content了，参数仍然保留给二进制appender使用
+        bool rendered() const { return _rendered; }
+        void setRendered() { _rendered = true; }
+
+        // 以下用于二进制日志
+        // 调用处传入的格式串指针, 只用来区分调用位置，不会访问
+        const void* site() const { return _site; }
+        std::string_view format() const;
+        // 每个参数的类型码: b/h/i/q 有符号整数(1/2/4/8字节), 大写为无符号, f/d/D 浮点, p 指针, s 字符串
+        const char* signature() const { return _signature; }
+        // 打包后的参数: 数值按原始字节保存, 字符串为u32长度 + 内容 + '\0'
+        std::string_view args() const;
+
+    private:
+        template <typename T>
+        struct Packer;
+        template <typename... Args>
+        static void renderImpl(const std::byte* data, std::string& out);
+        template <typename... Args>
+        static const char* signatureOf();
+
+    private:
+        RenderMethod _render = nullptr;
+        const void* _site = nullptr;
+        const char* _signature = "";
+        uint32_t _size = 0;
+        bool _rendered = false;
+        std::byte _data[QLOG_DEFERRED_ARGS_SIZE];
+    };
+
+    // 结构化字段, 按类型原样保存在事件内的缓冲区里, 不做字符串转换也不申请内存。
+    class Fields
+    {
+    public:
+        enum class Type : uint8_t
+        {
+            Int,
+            UInt,
+            Double,
+            Bool,
+            String
+        };
+        struct Value
+        {
+            Type type;
+            int64_t i = 0;
+            uint64_t u = 0;
+            double d = 0;
+            bool b = false;
+            std::string_view s;
+        };
+
+        // 拷贝key和value, 放不下时返回false
+        template <typename T>
+        bool add(std::string_view key, const T& value);
+        // 按添加顺序遍历, f(std::string_view key, const Value& value)
+        template <typename F>
+        void forEach(F&& f) const;
+        bool empty() const { return _size == 0; }
+        void clear() { _size = 0; }
+
+    private:
+        bool append(std::string_view key, Type type, const void* value, size_t size);
+
+    private:
+        uint32_t _size = 0;
+        std::byte _data[QLOG_FIELDS_SIZE];
     };
 
     // 日志格式化类, 根据特定格式，将数据格格式化成字符串。
     class Formatter
     {
     public:
+        // 时间的精度
+        enum class Precision
+        {
+            Seconds,
+            Milliseconds,
+            Microseconds,
+            Nanoseconds
+        };
         virtual ~Formatter() = default;
         using Ptr = std::shared_ptr<Formatter>;
         //
         virtual std::string format(std::shared_ptr<Event> logEvent);
+        // 格式化后追加到out, appender用它把日志写到复用的缓冲区里。
+        // 只重写了format的子类会调用子类的format。
+        virtual void formatTo(const std::shared_ptr<Event>& logEvent, std::string& out);
+        void setPrecision(Precision precision) { _precision = precision; }
+        Precision precision() const { return _precision; }
+
+    protected:
+        // 追加"YYYY-MM-DD hh:mm:ss"以及毫秒/微秒/纳秒, 每个线程缓存上一次的结果，只重写变化的部分
+        static void appendDateTime(std::string& out, int64_t timeNs, Precision precision);
+
+    private:
+        void formatDefault(const std::shared_ptr<Event>& logEvent, std::string& out);
+
+    private:
+        Precision _precision = Precision::Seconds;
+    };
+
+    // 按格式串格式化, 格式串在构造时解析成操作列表，格式化时按顺序追加，只计算用到的字段。
+    // %Y 年 %m 月 %d 日 %H 时 %M 分 %S 秒(UTC, 两位数字), %D 等同%Y-%m-%d, %T 等同%H:%M:%S,
+    // %e 毫秒(3位) %f 微秒(6位) %F 纳秒(9位), %l 级别 %L 级别首字母, %t 线程ID, %N 线程名(没有名字时为线程ID), %s 文件名 %# 行号,
+    // %n 日志key %q 错误码, %v 日志内容, %% 百分号。其他字符原样输出。
+    // 例如 PatternFormatter("%Y-%m-%d %H:%M:%S.%e [%l] [%t] %s:%# %v")
+    class PatternFormatter : public Formatter
+    {
+    public:
+        explicit PatternFormatter(std::string_view pattern);
+        std::string format(std::shared_ptr<Event> logEvent) override;
+        void formatTo(const std::shared_ptr<Event>& logEvent, std::string& out) override;
+
+    private:
+        enum class Op : uint8_t
+        {
+            Literal,
+            // YYYY-MM-DD hh:mm:ss, 使用appendDateTime的缓存
+            DateTime,
+            Year,
+            Month,
+            Day,
+            Hour,
+            Minute,
+            Second,
+            Millis,
+            Micros,
+            Nanos,
+            Level,
+            ShortLevel,
+            Thread,
+            ThreadName,
+            File,
+            Line,
+            Key,
+            Code,
+            Message
+        };
+        struct Step
+        {
+            Op op;
+            // Literal在_literals中的位置
+            uint32_t offset = 0;
+            uint32_t length = 0;
+        };
+        void addLiteral(std::string_view text);
+
+    private:
+        std::vector<Step> _steps;
+        // 所有字面量连续存放
+        std::string _literals;
+        // 是否用到了年月日时分秒中的单个字段
+        bool _needTm = false;
+    };
+
+    // 每条日志输出为一行JSON:
+    // {"time":"2024-01-01T00:00:00.000Z","level":"INFO","thread":1,"file":"main.cpp","line":1,"key":"global","message":"...","fields":{...}}
+    // 没有字段时不输出fields, 时间精度由setPrecision设置, 默认毫秒。
+    class JsonFormatter : public Formatter
+    {
+    public:
+        JsonFormatter() { setPrecision(Precision::Milliseconds); }
+        std::string format(std::shared_ptr<Event> logEvent) override;
+        void formatTo(const std::shared_ptr<Event>& logEvent, std::string& out) override;
+        // 转义后追加到out, 不包括两边的引号
+        static void appendEscaped(std::string& out, std::string_view text);
     };
 
     // 日志事件, 每次写日志其实是一个事件，同步事件直接写，如果是异步事件则加入到日志记录的事件循环。
@@ -124,33 +527,117 @@ namespace ray::log
         Event()
             : level(Level::Debug)
         { }
+        Event(const Event&) = delete;
+        Event& operator=(const Event&) = delete;
+        // 从当前线程的对象池里取一个事件，引用计数归零后自动清空并放回对象池
+        static Ptr create();
 
-        // 当前时间
+        // 当前时间, 毫秒
         // std::shared_ptr<struct tm> time;
         int64_t time = 0;
+        // 当前时间, 纳秒, 精度取决于系统时钟
+        int64_t timeNs = 0;
         // 等级
         Level level;
         // 错误码
         int code = 0;
         // 行号
         uint32_t line = 0;
-        // 文件名
-        std::string file;
+        // 文件名, 一般指向__FILE__, 动态字符串请用setFile
+        std::string_view file;
+        // ClockSource::Tsc时写日志的线程只记录TSC计数, 分发前由resolveTime换算成time和timeNs, 换算后为0
+        uint64_t ticks = 0;
         // 线程ID
         uint32_t threadId = 0;
+        // 线程名, 没有设置时为空; 指向的字符串不会释放
+        std::string_view threadName;
         // 日志内容
         Stream content;
+        // 还没有格式化的参数, 在分发到appender前格式化到content
+        DeferredArgs deferred;
+        // 结构化字段
+        Fields fields;
 
         // 本次的格式化方法，如果为空则使用，appender自己的格式化方法。
         Formatter::Ptr formatter;
-        // key
-        std::string key = "global";
+        // key, 一般指向字符串常量, 动态字符串请用setKey
+        std::string_view key = "global";
+        // 本次日志要写入的appender, 为0则使用DEFAULT_APPENDERS
+        AppenderMask appenders = 0;
         // std::string pattern;
 
+        // 拷贝一份再引用，不要求字符串的生命周期
+        void setFile(std::string_view file);
+        void setKey(std::string_view key);
+        // 没有任何日志内容
+        bool empty() const { return deferred.empty() && content.size() == 0; }
+        // 占用的内存, 包括超出内联缓冲区的内容
+        size_t memoryUsage() const { return sizeof(Event) + (content.size() > QLOG_INLINE_MESSAGE_SIZE ? content.size() : 0); }
+        // 把延迟格式化的参数格式化到content, 参数保留给二进制appender
+        void materialize();
+        // 把TSC计数换算成time和timeNs
+        void resolveTime();
+        // 要继续追加内容前调用, 之后参数不再代表完整的日志内容
+        void prepareAppend();
+        // 恢复到刚构造的状态，放回对象池前调用
+        void reset();
+
         // 转为流
         // std::string toString(Formatter::Ptr formatter) {
         //  return formatter->format(shared_from_this());
         //}
+
+    private:
+        std::string _fileStorage;
+        std::string _keyStorage;
+    };
+
+    // 日志时间戳的来源
+    enum class ClockSource : uint8_t
+    {
+        // system_clock, 默认
+        System,
+        // CLOCK_REALTIME_COARSE, 最快但是精度只有几毫秒; 其他平台等同System
+        Coarse,
+        // x86的TSC计数器, 写日志时只读计数器, 分发前按校准结果换算成纳秒; CPU没有不变TSC时等同System
+        Tsc
+    };
+
+    // 日志时钟。Tsc模式下以一对(TSC, 系统时间)为基准换算, 换算时如果距离上次校准超过1秒就重新校准,
+    // 异步模式下换算和校准都在后台线程。
+    class Clock
+    {
+    public:
+        // 切换到Tsc时会先校准约10毫秒
+        static void setSource(ClockSource source);
+        static ClockSource source() { return _source.load(std::memory_order_relaxed); }
+        // 给事件打时间戳
+        static void stamp(Event& event);
+        // TSC计数换算成纳秒(UTC)
+        static int64_t toNanoseconds(uint64_t ticks);
+        // CPU是否支持不变TSC(频率不随变频和休眠改变)
+        static bool tscAvailable();
+
+    private:
+        static uint64_t readTsc();
+        static int64_t systemNow();
+        // 取一对尽量在同一时刻的TSC和系统时间
+        static void samplePair(uint64_t& ticks, int64_t& ns);
+        // 重新取基准并修正频率, 同一时间只有一个线程调用
+        static void calibrate(bool initial);
+
+    private:
+        static constexpr int64_t CALIBRATE_INTERVAL = 1000000000;
+        inline static std::atomic<ClockSource> _source{ClockSource::System};
+        // 换算基准, 用序号保证读到的是同一次校准的结果(seqlock), 序号为奇数时正在更新
+        inline static std::atomic<uint32_t> _sequence{0};
+        inline static std::atomic<uint64_t> _baseTicks{0};
+        inline static std::atomic<int64_t> _baseNs{0};
+        inline static std::atomic<double> _nsPerTick{0};
+        inline static std::atomic_flag _calibrating = ATOMIC_FLAG_INIT;
+        // 第一次校准的基准, 用越来越长的时间差计算频率, 只在校准时访问
+        inline static uint64_t _anchorTicks = 0;
+        inline static int64_t _anchorNs = 0;
     };
 
     // 日志交互类
@@ -166,11 +653,13 @@ namespace ray::log
          * @param level
          * @param[in] appenders 本次的日志要记录在哪儿，默认全部的appender
          */
-        explicit Logger(const std::string& file = std::source_location::current().file_name(),
+        explicit Logger(std::string_view file = std::source_location::current().file_name(),
             uint32_t line = std::source_location::current().line(),
             Level level = Level::Info,
             std::list<std::string> appenders = {});
-        explicit Logger(const std::string& key, const std::string& file, uint32_t line, Level level = Level::Info, std::list<std::string> appenders = {});
+        explicit Logger(std::string_view key, std::string_view file, uint32_t line, Level level = Level::Info, std::list<std::string> appenders = {});
+        // appenders由AppenderRegistry::mask提前解析好，避免每条日志查找appender名
+        Logger(std::string_view file, uint32_t line, Level level, AppenderMask appenders);
         /**
          * @brief 写日志
          * @usage: Logger(Level::Debug).log("%d, %d, %.2f, %s", 1, 2, 4.1, "hello");
@@ -188,6 +677,12 @@ namespace ray::log
         void error(T format, Args... args);
         template <typename T = const char*, typename... Args>
         void fatal(T format, Args... args);
+        /**
+         * @brief std::format风格写日志, 格式串在编译期检查，直接格式化到事件的缓冲区，没有中间字符串
+         * @usage: Logger(Level::Debug).fmt("{}, {:.2f}, {}", 1, 4.1, "hello");
+         */
+        template <typename... Args>
+        void fmt(std::format_string<Args...> format, Args&&... args);
 
     private:
         void flush();
@@ -200,18 +695,22 @@ namespace ray::log
         Logger& set_level(Level level);
         // 错误码
         Logger& set_code(int code);
+        // 添加结构化字段, 支持数值、bool和字符串, 例如 .with("user_id", 42).with("latency_us", 137)
+        template <typename T>
+        Logger& with(std::string_view key, const T& value);
         // 设置appender
         Logger& set_appenders(std::list<std::string> appenders);
+        Logger& set_appenders(AppenderMask appenders);
         // 设置格式
         Logger& set_formatter(Formatter::Ptr formatter);
         // 行号
         Logger& set_line(uint32_t line);
         // 文件
-        Logger& set_file(std::string file);
+        Logger& set_file(std::string_view file);
         // Logger& pattern(std::string pattern) {
         //  return *this;
         // }
-        Logger& set_key(const std::string& key);
+        Logger& set_key(std::string_view key);
         Logger& operator()(Level);
 
         template <typename T = const char*>
@@ -226,7 +725,57 @@ namespace ray::log
 
     private:
         Event::Ptr _logEvent;
-        std::list<std::string> _appenders;
+    };
+
+    // 延迟直方图(纳秒), 按2的幂分段, 每段8个桶, 误差不超过12.5%。记录只有几次relaxed原子操作。
+    class LatencyHistogram
+    {
+    public:
+        struct Summary
+        {
+            uint64_t count = 0;
+            uint64_t mean = 0;
+            uint64_t p50 = 0;
+            uint64_t p90 = 0;
+            uint64_t p99 = 0;
+            uint64_t p999 = 0;
+            uint64_t max = 0;
+        };
+        void record(uint64_t ns);
+        Summary summary() const;
+
+    private:
+        static size_t bucket(uint64_t ns);
+        // 桶内的最大值
+        static uint64_t upperBound(size_t index);
+
+    private:
+        static constexpr size_t BUCKETS = 62 * 8;
+        std::atomic<uint64_t> _buckets[BUCKETS] = {};
+        std::atomic<uint64_t> _count{0};
+        std::atomic<uint64_t> _sum{0};
+        std::atomic<uint64_t> _max{0};
+    };
+
+    // 单个appender的运行指标
+    struct AppenderMetrics
+    {
+        // 交给appender写的日志数
+        std::atomic<uint64_t> events{0};
+        // 发给了appender但是级别不够的日志数
+        std::atomic<uint64_t> filtered{0};
+        // 写失败或者被appender丢弃的日志数
+        std::atomic<uint64_t> dropped{0};
+        // 写出的字节数
+        std::atomic<uint64_t> bytes{0};
+        // 分割文件的次数
+        std::atomic<uint64_t> rotations{0};
+        // Formatter::formatTo的耗时
+        LatencyHistogram formatTime;
+        // Appender::flush的耗时, 包括格式化
+        LatencyHistogram flushTime;
+        // 等待_mtxFlush的耗时, 只记录没能直接拿到锁的情况
+        LatencyHistogram lockWait;
     };
 
     // 负责写日志的组件, 每一个appender有自己的level等级
@@ -241,29 +790,96 @@ namespace ray::log
     public:
         virtual ~Appender() = default;
         using Ptr = std::shared_ptr<Appender>;
-        void setLevel(Level level) { _level = level; }
-        Level level() { return _level; };
+        void setLevel(Level level);
+        Level level() { return _level.load(std::memory_order_relaxed); };
         // void setPattern();
-        void setFormatter(Formatter::Ptr formatter) { _formatter = formatter; }
+        virtual void setFormatter(Formatter::Ptr formatter) { _formatter = formatter; }
         // 写日志
         bool write(Event::Ptr);
         virtual bool flush(const Event::Ptr) = 0;
+        // 没有新日志时由后台线程定期调用，用于按时间刷新缓冲区等; final为true时是后台线程退出前最后一次调用
+        void idle(bool final = false);
+        // 合并连续重复的日志(内容、级别和位置都相同), 重复的只计数，内容变化或者超过timeout后
+        // 写一条"last message repeated N times"。默认关闭。
+        void setCollapseDuplicates(bool enable, std::chrono::milliseconds timeout = std::chrono::seconds(5));
+        // 进程崩溃时在信号处理函数中调用, 把缓冲的日志和message写出去, frames为调用栈。
+        // 只能使用异步信号安全的函数, 不能加锁也不能申请内存。
+        virtual void onCrash(std::string_view /*message*/, void* const* /*frames*/, int /*depth*/) { }
+        // 异步队列积压时的处理方式, 默认Block
+        void setOverflowPolicy(OverflowPolicy policy) { _overflowPolicy = policy; }
+        OverflowPolicy overflowPolicy() const { return _overflowPolicy.load(std::memory_order_relaxed); }
+        const AppenderMetrics& metrics() const { return _metrics; }
 
     protected:
+        virtual void onIdle() { }
+        // 子类析构时调用, 写出还没写的重复次数。基类析构时子类已经不在了, 只能由子类调用
+        void finishRepeats();
         Formatter::Ptr getFormatter(Event::Ptr);
+        // 用事件或者appender的格式化方法追加到out, 并统计耗时
+        void formatTo(const Event::Ptr& event, std::string& out);
+        // 格式化到复用的缓冲区，只能在flush中使用
+        const std::string& render(const Event::Ptr& event);
+
+    private:
+        // 调用前需要持有_mtxFlush; 返回true表示是重复的日志, 已经计数
+        bool collapse(const Event::Ptr& event);
+        // 写出重复次数
+        void flushRepeats();
+        // 同步模式下由dispatch调用, 超时了就写出重复次数
+        void expireRepeats();
 
     protected:
-        Level _level = Level::Info;
+        std::atomic<Level> _level = Level::Info;
+        std::atomic<OverflowPolicy> _overflowPolicy = OverflowPolicy::Block;
         Formatter::Ptr _formatter;
 
         std::mutex _mtxFlush;
+        // 受_mtxFlush保护
+        std::string _line;
+        AppenderMetrics _metrics;
+
+    private:
+        friend class AppenderRegistry;
+        // 以下受_mtxFlush保护
+        bool _collapse = false;
+        std::chrono::milliseconds _collapseTimeout{5000};
+        // 上一条日志的内容、级别和位置的哈希
+        size_t _lastHash = 0;
+        Event::Ptr _lastEvent;
+        uint64_t _repeats = 0;
+        std::chrono::steady_clock::time_point _firstRepeat;
     };
 
     class ConsoleAppender : public Appender
     {
     public:
-        ConsoleAppender() { _level = Level::Debug; }
+        ConsoleAppender();
+        ~ConsoleAppender();
         bool flush(const Event::Ptr) override;
+        // 按级别显示颜色, 默认只在stdout是终端并且没有设置NO_COLOR时开启
+        void setColor(bool enable);
+        // stdout写不进去(管道满了)时丢弃Debug日志，而不是阻塞等待; 之后会输出丢弃的数量
+        void setDropDebugOnPressure(bool enable);
+        void onCrash(std::string_view message, void* const* frames, int depth) override;
+
+    protected:
+        void onIdle() override;
+
+    private:
+        // 调用前需要持有_mtxFlush; force为false时stdout写不进去就先不写
+        void writeBatch(bool force);
+
+    private:
+#ifndef USE_QT
+        // 异步模式下攒一批日志一起写，后台线程空闲时或者攒够了再写
+        std::string _batch;
+        static constexpr size_t BATCH_SIZE = 64 * 1024;
+        bool _color = false;
+        bool _dropDebug = false;
+        // 上次写的时候stdout写不进去
+        bool _pressure = false;
+        size_t _dropped = 0;
+#endif
     };
 
     // class FileSplitPerDay {};
@@ -274,13 +890,98 @@ namespace ray::log
     // }
 #define MB
 
+    // 后台压缩分割出来的旧日志文件, 压缩成.gz后删除原文件，并按保留策略删除最旧的归档。
+    // 只在单独的低优先级线程中读写文件，提交任务只是入队，不会阻塞写日志的线程。
+    class LogArchiver
+    {
+    public:
+        // 归档的保留策略，0表示不限制
+        struct Retention
+        {
+            // 最多保留的归档文件数量
+            size_t maxFiles = 0;
+            // 所有归档文件的总大小上限, 字节
+            uint64_t maxBytes = 0;
+        };
+
+        ~LogArchiver();
+        // 压缩filename, 完成后在directory(包括子目录)下按retention清理.gz文件
+        void submit(std::string filename, std::string directory, Retention retention);
+        // 等待已提交的任务全部完成
+        void wait();
+        // 把source压缩成gzip格式的target, 先写到临时文件再重命名
+        static bool compress(const std::string& source, const std::string& target);
+        static LogArchiver& instance();
+
+    private:
+        LogArchiver() = default;
+        struct Task
+        {
+            std::string filename;
+            std::string directory;
+            Retention retention;
+        };
+        void run();
+        static void applyRetention(const std::string& directory, const Retention& retention);
+        // 内置的gzip压缩: LZ77 + 固定哈夫曼编码
+        static void deflate(const char* data, size_t size, std::string& out);
+        static uint32_t crc32(const char* data, size_t size);
+
+    private:
+        std::thread _thread;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::condition_variable _idle;
+        std::list<Task> _tasks;
+        bool _busy = false;
+        bool _stop = false;
+    };
+
+    // 日志文件, 直接使用文件描述符写入, 缓冲由FileAppender管理
+    class LogFile
+    {
+    public:
+        LogFile() = default;
+        LogFile(const LogFile&) = delete;
+        LogFile& operator=(const LogFile&) = delete;
+        LogFile(LogFile&& other) noexcept { *this = std::move(other); }
+        LogFile& operator=(LogFile&& other) noexcept;
+        ~LogFile() { close(); }
+        // 以追加方式打开，不存在则创建
+        bool open(const std::string& filename);
+        void close();
+        bool isOpen() const { return _fd >= 0; }
+        bool write(const char* data, size_t size);
+        // 把系统缓存写到磁盘
+        void sync();
+        // 文件大小, 字节
+        size_t size() const { return _size; }
+        int fd() const { return _fd; }
+
+    private:
+        int _fd = -1;
+        size_t _size = 0;
+    };
+
     class FileAppender : public Appender
     {
     public:
+        // 什么时候调用fdatasync把数据写到磁盘
+        enum class SyncPolicy
+        {
+            // 交给操作系统
+            Never,
+            // 每次按时间间隔刷新时
+            Interval,
+            // 写入Error及以上级别的日志时
+            OnError
+        };
+
     public:
         FileAppender();
         virtual ~FileAppender();
         // 接收日志事件和FileAppender并返回新的文件名。如果文件名不变则不会进行分割。
+        // 设置了分割策略后每条日志都会调用一次; 不设置则使用内置的按天(UTC)和大小分割, 每条日志只比较时间和大小。
         using FileSplitPolicy = std::function<std::string(Event::Ptr, FileAppender&)>;
         // 设置最后路径，最好不要加最后一个/
         void setBasePath(const std::string& basePath);
@@ -298,12 +999,73 @@ namespace ray::log
         std::string path() const;
         // 顶层路径
         std::string basePath() const;
+        // 缓冲区大小，0表示每条日志都直接写文件(默认)。缓冲区满、到了刷新间隔或者写入Error及以上级别的日志时写文件。
+        void setBufferSize(size_t size);
+        // 缓冲区的刷新间隔
+        void setFlushInterval(std::chrono::milliseconds interval);
+        void setSyncPolicy(SyncPolicy policy);
+        // 把缓冲区写入文件
+        void flushBuffer();
+        // 默认分割策略使用的文件扩展名, 默认为.log
+        void setExtension(const std::string& extension);
+        std::string extension() const;
+        // 内置分割策略的文件大小上限, 默认10MB
+        void setMaxFileSize(size_t size);
+        // 分割出来的旧文件在后台压缩成.gz
+        void setCompression(bool enable);
+        // 压缩后的归档在basePath下最多保留的数量和总大小, 0表示不限制
+        void setRetention(size_t maxFiles, uint64_t maxBytes = 0);
+        // 写出缓冲区, 再把message和调用栈追加到当前文件
+        void onCrash(std::string_view message, void* const* frames, int depth) override;
+
+    protected:
+        // 崩溃时只把缓冲区写到当前文件
+        void writeBufferOnCrash();
+        void onIdle() override;
+        // 把一条日志编码后追加到out, 默认是格式化后的一行文本
+        virtual void encode(const Event::Ptr& event, std::string& out);
+        // 打开了新的日志文件
+        virtual void onFileOpened() { }
 
     private:
+        friend class RoutingFileAppender;
+        // 写出缓冲区并关闭文件, 释放文件描述符; 下次写日志时重新打开同一个文件接着写, 分割状态不变
+        void suspend();
+
+        // 提前在后台打开的下一个文件
+        struct PreparedFile
+        {
+            // 以/结尾
+            std::string path;
+            std::string filename;
+            // 文件所属的那一天的开始时间, 毫秒
+            int64_t dayStart = 0;
+            bool bySize = false;
+            // 文件是新创建的, 没用上就删掉
+            bool created = false;
+            LogFile file;
+        };
+        // 内置分割策略: 创建目录, 打开timeMs所在那一天的文件, bySize时文件名带上时分秒
+        static PreparedFile openFile(const std::string& basePath, const std::string& extension, int64_t timeMs, bool bySize);
         bool resetFile(Event::Ptr);
+        // 内置分割策略切换到新文件
+        bool rotate(int64_t timeMs);
+        // 在后台打开下一个文件
+        void prepareNextFile(int64_t timeMs, bool bySize);
+        // 关闭没有用上的预先打开的文件, 新建的空文件会被删除
+        static void discardFile(PreparedFile& prepared);
+        // 换新文件前关闭当前文件, 计一次分割; fullPath是当前文件的完整路径, 用于压缩
+        void closeFile(const std::string& fullPath);
+        // 调用前需要持有_mtxFlush
+        bool writeBuffer(bool sync);
 
     private:
-        std::ofstream _file;
+        LogFile _file;
+        std::string _buffer;
+        size_t _bufferSize = 0;
+        std::chrono::milliseconds _flushInterval{1000};
+        std::chrono::steady_clock::time_point _lastFlush;
+        SyncPolicy _syncPolicy = SyncPolicy::Never;
         // 不要加最后一个/
         std::string _basePath;
         // 除去文件名的路径
@@ -312,6 +1074,198 @@ namespace ray::log
         std::string _filename;
         // 文件分割策略
         FileSplitPolicy _fileSplitPolicy = nullptr;
+        std::string _extension = ".log";
+        bool _compression = false;
+        LogArchiver::Retention _retention;
+        // 内置分割策略: 当前文件对应的时间范围[_dayStart, _dayEnd), 毫秒
+        int64_t _dayStart = 0;
+        int64_t _dayEnd = 0;
+        size_t _maxFileSize = 10 * 1024 * 1024;
+        std::future<PreparedFile> _prepared;
+        // 文件被suspend关闭了
+        bool _suspended = false;
+        // 提前多久打开第二天的文件, 毫秒
+        static constexpr int64_t PREPARE_AHEAD = 60 * 1000;
+    };
+
+    // 二进制日志, 每个调用位置的格式串、文件名和行号只在字典里写一次，之后每条日志只记录
+    // 位置编号、时间、线程、级别和打包好的参数，用decode(或qlog_decode工具)还原成文本。
+    // 文件格式(本机字节序):
+    //   文件头  "QLOGBIN1"
+    //   字典项  'S' u32 位置编号, u32 行号, u16 文件名长度 + 文件名, u16 类型码长度 + 类型码, u32 格式串长度 + 格式串
+    //   日志    'E' u32 位置编号, i64 纳秒时间, u32 线程ID, u8 级别, u32 参数长度 + 参数(见DeferredArgs::args)
+    // 不是通过log("%d", ...)写的日志(<<, fmt)按格式串"%s"保存为一个字符串参数。
+    class BinaryFileAppender : public FileAppender
+    {
+    public:
+        BinaryFileAppender();
+        // FileAppender析构时已经不能按二进制格式编码了, 重复次数要在这里写出
+        ~BinaryFileAppender();
+        // 把二进制日志文件转成文本，每条一行, formatter为空时使用默认格式
+        static bool decode(const std::string& filename, std::ostream& out, Formatter::Ptr formatter = nullptr);
+        // 按类型码读取打包好的参数，用格式串格式化后追加到out
+        static void renderArgs(std::string_view format, std::string_view signature, std::string_view args, std::string& out);
+
+        // 文本会破坏文件格式, 只写出缓冲区
+        void onCrash(std::string_view message, void* const* frames, int depth) override;
+
+    protected:
+        void encode(const Event::Ptr& event, std::string& out) override;
+        void onFileOpened() override;
+
+    private:
+        static constexpr char MAGIC[8] = {'Q', 'L', 'O', 'G', 'B', 'I', 'N', '1'};
+        // 调用位置, 按文件名的内容比较: 不同编译单元里的同一个__FILE__不一定是同一个指针, set_file的文件名也是拷贝
+        struct SiteKey
+        {
+            std::string file;
+            uint32_t line;
+            const void* format;
+        };
+        // 查找时不拷贝文件名
+        struct SiteView
+        {
+            std::string_view file;
+            uint32_t line;
+            const void* format;
+        };
+        struct SiteKeyHash
+        {
+            using is_transparent = void;
+            size_t operator()(const SiteView& key) const
+            {
+                return std::hash<std::string_view>()(key.file) ^ (std::hash<const void*>()(key.format) << 1) ^ key.line;
+            }
+            size_t operator()(const SiteKey& key) const { return (*this)(SiteView{key.file, key.line, key.format}); }
+        };
+        struct SiteKeyEqual
+        {
+            using is_transparent = void;
+            template <typename A, typename B>
+            bool operator()(const A& a, const B& b) const
+            {
+                return a.line == b.line && a.format == b.format && std::string_view(a.file) == std::string_view(b.file);
+            }
+        };
+        struct Site
+        {
+            uint32_t id;
+            // 用于确认格式串指针没有被复用成别的内容
+            std::string format;
+            std::string signature;
+        };
+
+    private:
+        std::unordered_map<SiteKey, Site, SiteKeyHash, SiteKeyEqual> _sites;
+        uint32_t _nextSiteId = 0;
+        // 新文件需要先写文件头
+        bool _needHeader = true;
+    };
+
+    // 按日志的key(Logger::set_key)写到不同的文件: basePath/key/年/月/年-月-日.log, 每个key有自己的
+    // FileAppender, 按天和大小分割、压缩和保留数量都是每个key单独计算。
+    // 同时打开的文件数有上限, 超过时关闭最久没写过的key的文件, 再写时重新打开接着写。
+    // key中文件名不允许的字符替换为'_', 替换后相同的key写到同一个文件。
+    class RoutingFileAppender : public Appender
+    {
+    public:
+        RoutingFileAppender();
+        ~RoutingFileAppender();
+        // 每个key新建FileAppender后调用, 用于设置缓冲、分割大小、压缩等, 路径和格式已经设置好
+        using FileInitializer = std::function<void(FileAppender&)>;
+        // 所有key的上层目录, 不要加最后一个/
+        void setBasePath(const std::string& basePath);
+        std::string basePath() const;
+        void setFileInitializer(const FileInitializer& initializer);
+        // 同时打开的文件数上限, 默认64。快到分割点的key还会在后台提前打开下一个文件, 最多再多一倍
+        void setMaxOpenFiles(size_t count);
+        // 当前打开的文件数
+        size_t openFiles();
+        bool flush(const Event::Ptr) override;
+        // 已经创建的key也改用新的格式
+        void setFormatter(Formatter::Ptr formatter) override;
+        // 写出所有打开文件的缓冲区, 再把message和调用栈追加到最近写过的那个key的文件
+        void onCrash(std::string_view message, void* const* frames, int depth) override;
+
+    protected:
+        void onIdle() override;
+
+    private:
+        struct Route
+        {
+            std::shared_ptr<FileAppender> appender;
+            // 在_open中的位置, 文件关闭时为_open.end()
+            std::list<Route*>::iterator open;
+            // 已经计入_metrics的写入量和分割次数
+            uint64_t bytes = 0;
+            uint64_t rotations = 0;
+        };
+        // 把key转换成目录名, 结果放在_name
+        void sanitize(std::string_view key);
+        // 关闭最久没写过的文件直到不超过上限
+        void evict();
+        // 把key的FileAppender新增的写入量和分割次数计入_metrics
+        void collect(Route& route);
+
+    private:
+        // 以下受_mtxFlush保护
+        std::string _basePath;
+        FileInitializer _initializer;
+        size_t _maxOpenFiles = 64;
+        std::unordered_map<std::string, Route> _routes;
+        // 打开了文件的key, 最近写过的在前面
+        std::list<Route*> _open;
+        std::string _name;
+    };
+
+    // 固定大小的环形日志文件, 通过内存映射写入，写满后覆盖最旧的日志。
+    // 写日志只是memcpy，没有系统调用; 文件头记录了读写位置，进程崩溃后日志仍然在文件里，用read读取。
+    class RingFileAppender : public Appender
+    {
+    public:
+        RingFileAppender() = default;
+        virtual ~RingFileAppender();
+        // 打开或创建环形文件, capacity为数据区大小。已存在且大小相同的文件会接着写。
+        bool open(const std::string& filename, size_t capacity = 4 * 1024 * 1024);
+        void close();
+        bool flush(const Event::Ptr) override;
+        // 按从旧到新的顺序读出文件中的所有日志
+        static std::vector<std::string> read(const std::string& filename);
+
+    private:
+        struct Header
+        {
+            char magic[8];
+            uint32_t version;
+            uint32_t headerSize;
+            uint64_t capacity;
+            // 下一条日志的写入位置
+            uint64_t writePos;
+            // 最旧一条完整日志的位置
+            uint64_t tailPos;
+        };
+        static constexpr char MAGIC[8] = {'Q', 'L', 'O', 'G', 'R', 'I', 'N', 'G'};
+        static constexpr uint32_t VERSION = 1;
+        static constexpr uint32_t HEADER_SIZE = 64;
+        // 数据区末尾放不下下一条日志时写入的标记，读到它就回到开头
+        static constexpr uint32_t WRAP_MARKER = 0xFFFFFFFFu;
+        static_assert(sizeof(Header) <= HEADER_SIZE);
+
+        void append(const char* data, uint32_t size);
+        // tail越过一条日志, 越过最旧数据段的末尾时回到开头
+        void advanceTail();
+        uint32_t readLength(uint64_t pos) const;
+
+    private:
+        Header* _header = nullptr;
+        char* _data = nullptr;
+        size_t _mappedSize = 0;
+#ifdef QLOG_WINDOWS
+        HANDLE _fileHandle = INVALID_HANDLE_VALUE;
+        HANDLE _mapping = nullptr;
+#else
+        int _fd = -1;
+#endif
     };
 
     // 日志appender工厂
@@ -345,44 +1299,374 @@ namespace ray::log
     class AppenderRegistry
     {
     public:
+        // 最多支持的appender名数量, 受AppenderMask位数限制
+        static constexpr size_t MAX_APPENDERS = 64;
+        ~AppenderRegistry();
         // 所有定义的logger都应该是单例的，这里存储了这些单例,  使用name可兼容同一个种appender多个实例，以便输出到不同的位置。
         const Appender::Ptr get(const std::string& name);
+        // appender名对应的位，同一个名字永远对应同一位, 可以在addAppenders之前调用。
+        AppenderMask mask(const std::list<std::string>& names);
+        // DEFAULT_APPENDERS对应的位
+        AppenderMask defaultMask();
         void addAppenders(std::list<std::string> appenders);
         void clear();
+        // 将事件分发到它指定的appender, 同步模式在调用线程执行，异步模式在后台线程执行
+        void dispatch(const Event::Ptr& event);
+        // 所有appender中最低的日志级别，低于它的日志不会被任何appender写入
+        static Level minLevel() { return _minLevel.load(std::memory_order_relaxed); }
+        // appender增删或者修改了级别后重新计算minLevel
+        void updateMinLevel();
+        // 通知所有appender当前没有新日志, final见Appender::idle
+        void idle(bool final = false);
+        // 事件要写入的appender中最严格的积压处理方式; 只会被backtrace保存的日志为DropNewest, 没有appender会写也不会保存时返回空
+        std::optional<OverflowPolicy> overflowPolicy(const Event::Ptr& event);
+        // 所有appender名和实例的拷贝
+        std::map<std::string, Appender::Ptr> appenders();
+        // 通知所有appender进程崩溃了, 只在信号处理函数中调用, 不加锁
+        void crash(std::string_view message, void* const* frames, int depth);
+        // backtrace模式: 低于appender级别但不低于level的日志不丢弃, 每个线程保存最近的capacity条,
+        // 写Error及以上级别的日志前先把它们按时间顺序写到同一个appender。保存时不格式化也不和其他线程竞争, 可以一直开着。
+        // capacity为0时关闭。
+        void enableBacktrace(size_t capacity, Level level = Level::Debug);
+        void disableBacktrace() { enableBacktrace(0); }
         // 获取所有的appender名
         // std::list<std::string> keys();
         static AppenderRegistry& instance();
 
     private:
+        friend class Appender;
         AppenderRegistry() = default;
+        // 调用前需要持有_mutex的写锁
+        uint32_t handle(const std::string& name);
+        // 根据_appenders生成新的快照并发布, 调用前需要持有_mutex的写锁
+        void publish();
+        // 等读旧快照的线程都离开后释放旧快照和它们持有的appender, 调用前不能持有_mutex
+        void reclaim();
 
     private:
+        // 发布后不再修改，写日志时只需要一次原子读取，不加锁也不比较字符串
+        struct Snapshot
+        {
+            Appender::Ptr appenders[MAX_APPENDERS];
+        };
+        // 读快照的线程计数, 按线程分散到不同的缓存行; 每个位置两个计数按_epoch交替使用, 释放时一定能等到归零
+        struct alignas(64) ReaderSlot
+        {
+            std::atomic<uint32_t> count[2] = {0, 0};
+        };
+        static constexpr size_t READER_SLOTS = 16;
+        // 存在期间读到的快照不会被释放
+        class Reader
+        {
+        public:
+            explicit Reader(AppenderRegistry& registry);
+            ~Reader();
+            Reader(const Reader&) = delete;
+            Reader& operator=(const Reader&) = delete;
+            const Snapshot* snapshot() const { return _snapshot; }
+
+        private:
+            std::atomic<uint32_t>* _count;
+            const Snapshot* _snapshot;
+        };
+        // backtrace保存的一条日志
+        struct BacktraceEntry
+        {
+            Event::Ptr event;
+            // 过滤掉了它、还没写过的appender
+            AppenderMask pending = 0;
+        };
+        // 每个线程一个, 只有所属线程写入, 锁基本不会有竞争
+        struct BacktraceRing
+        {
+            std::mutex mutex;
+            std::vector<BacktraceEntry> entries;
+            size_t next = 0;
+        };
+        // 保存一条被pending中的appender过滤掉的日志
+        void recordBacktrace(const Event::Ptr& event, AppenderMask pending);
+        // 把各线程保存的日志写到trigger会写入的appender中, 只写该appender之前过滤掉的; 其他appender的留着
+        void dumpBacktrace(const Snapshot* snapshot, const Event::Ptr& trigger, AppenderMask targets);
+
         std::map<std::string, Appender::Ptr> _appenders;
+        // appender名 -> 位
+        std::map<std::string, uint32_t> _handles;
+        std::atomic<const Snapshot*> _snapshot{nullptr};
+        // 旧的快照可能还有线程在读, 由reclaim释放, 受_mutex保护
+        std::vector<std::unique_ptr<const Snapshot>> _retired;
+        ReaderSlot _readers[READER_SLOTS];
+        std::atomic<uint64_t> _epoch{0};
+        // 同时只有一个线程在等读者离开
+        std::mutex _mtxReclaim;
+        // 当前线程正在读快照的层数, 读快照时不能等自己
+        inline static thread_local int _readDepth = 0;
+        std::atomic<AppenderMask> _defaultMask{0};
         std::shared_mutex _mutex;
+        inline static std::atomic<Level> _minLevel = Level::Debug;
+        // 有重复次数还没写出的appender数, 同步模式下不为0时dispatch才检查超时
+        inline static std::atomic<int> _pendingRepeats = 0;
+
+        // 保护_backtraceRings和_backtraceCapacity, 同时只有一个线程在写出backtrace
+        std::mutex _mtxBacktrace;
+        // 所有线程的环形缓冲区, 线程退出后还没写出的日志保留到写出为止
+        std::vector<std::shared_ptr<BacktraceRing>> _backtraceRings;
+        size_t _backtraceCapacity = 0;
+        std::atomic<bool> _backtraceEnabled{false};
+        std::atomic<Level> _backtraceLevel = Level::Debug;
     };
 
-    // std::map<std::string, Appender::Ptr> AppenderRegistry::_appenders;
-    //////////////////////////   实现代码   ///////////////////
-    // =============    Logger    ============
-    inline Logger::Logger(const std::string& file, uint32_t line, Level level, std::list<std::string> appenders /*= {}*/)
-        : Logger("global", file, line, level, appenders)
+    // 运行期过滤, 只是一次原子读取和比较。
+    inline bool shouldLog(Level level)
+    {
+        return level >= AppenderRegistry::minLevel();
+    }
+
+    // 一个调用位置的限流/采样状态, 由QLOG_EVERY_N、QLOG_FIRST_N、QLOG_RATE_LIMIT宏定义为该位置的静态变量。
+    // 被丢弃时只有一两次原子操作, 不会构造Logger; 下一条写出的日志带上suppressed字段，记录中间丢弃了多少条。
+    // 之后不再写日志的位置(FIRST_N超过次数、限流后不再调用)由reportSuppressed单独写一条丢弃数量。
+    class LogSite
+    {
+    public:
+        constexpr LogSite(const char* file, int line, Level level)
+            : _file(file), _line(line), _level(level)
+        {
+        }
+        // 每n次写一次
+        bool everyN(uint64_t n);
+        // 只写前n次
+        bool firstN(uint64_t n);
+        // 每秒最多写perSecond条, 令牌桶, 允许突发perSecond条
+        bool rateLimit(uint32_t perSecond);
+        // 有被丢弃的日志时给本次的Logger加上suppressed字段, 返回的引用在整条语句结束前有效
+        Logger& annotate(Logger&& logger);
+        // 给有丢弃数量的位置各写一条日志, 最多每秒一次。final为false时跳过上次之后还有日志带走过数量的位置,
+        // 它们的数量留给下一条日志; final为true时全部写出并且不限频率, 用于后台线程退出前。
+        // 异步模式由后台线程调用, 同步模式由dispatch调用
+        static void reportSuppressed(bool final = false);
+        // 有还没写出的丢弃数量
+        static bool hasSuppressed() { return _pending.load(std::memory_order_relaxed) > 0; }
+
+    private:
+        // 记录丢弃了n条, 第一次丢弃时加入_sites
+        void suppress(uint64_t n);
+        // 取出丢弃数量并清零
+        uint64_t takeSuppressed();
+
+        const char* _file;
+        int _line;
+        Level _level;
+        std::atomic<uint64_t> _count{0};
+        std::atomic<uint64_t> _suppressed{0};
+        // 令牌桶的理论到达时间(GCRA), 纳秒
+        std::atomic<int64_t> _tat{0};
+        // 上次reportSuppressed之后有日志带走过丢弃数量, 说明这个位置还在写
+        std::atomic<bool> _emitted{false};
+        // 已经加入_sites, 只加入不删除
+        std::atomic<bool> _listed{false};
+        LogSite* _next = nullptr;
+        inline static std::atomic<LogSite*> _sites{nullptr};
+        // _suppressed不为0的位置数
+        inline static std::atomic<int> _pending{0};
+        // 上次reportSuppressed的时间, 纳秒
+        inline static std::atomic<int64_t> _lastReport{0};
+    };
+
+    // 有界无锁多生产者单消费者队列, 容量会向上取整为2的幂。
+    template <typename T>
+    class MpscQueue
+    {
+    public:
+        explicit MpscQueue(size_t capacity);
+        // 队列满时返回false
+        bool tryPush(T&& value);
+        // 只允许一个消费者线程调用, 队列空时返回false
+        bool tryPop(T& value);
+        size_t capacity() const { return _mask + 1; }
+        // 队列中的元素数量, 只允许消费者线程调用, 生产者并发入队时是近似值
+        size_t size() const { return _enqueuePos.load(std::memory_order_relaxed) - _dequeuePos; }
+
+    private:
+        struct Cell
+        {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+        std::unique_ptr<Cell[]> _cells;
+        size_t _mask;
+        alignas(64) std::atomic<size_t> _enqueuePos{0};
+        alignas(64) size_t _dequeuePos = 0;
+    };
+
+    // 异步写日志, 开启后Logger只负责把事件放入队列，由后台线程写入appender。
+    class AsyncWorker
+    {
+    public:
+        ~AsyncWorker();
+        // 开启异步模式，capacity为队列长度
+        void start(size_t capacity = 8192);
+        // 关闭异步模式，会先把队列中剩余的日志写完
+        void stop();
+        bool running() const { return _running.load(std::memory_order_acquire); }
+        // 放入队列，未开启异步模式或者积压时按Synchronous处理时返回false, 由调用者同步写入
+        bool push(Event::Ptr event);
+        // 排队中的日志最多占用的内存, 0为不限制
+        void setMemoryBudget(size_t bytes) { _memoryBudget = bytes; }
+        // 因为积压被丢弃的日志总数
+        uint64_t droppedCount() const { return _dropped.load(std::memory_order_relaxed); }
+        // 排队中的日志占用的内存
+        size_t pendingBytes() const { return _pendingBytes.load(std::memory_order_relaxed); }
+        static AsyncWorker& instance();
+
+    private:
+        AsyncWorker();
+        void run();
+        // 写完队列中的所有事件, 返回写入的数量
+        size_t drain();
+        // 距离上次报告超过1秒并且有新丢弃的日志时, 写一条Warning
+        void reportDropped();
+        // 到了Metrics的报告间隔时写一条Info
+        void reportMetrics();
+        // 在后台线程直接写一条qlog自己的日志, 不经过队列
+        static void emit(Level level, std::string_view message);
+
+    private:
+        std::unique_ptr<MpscQueue<Event::Ptr>> _queue;
+        std::atomic<size_t> _memoryBudget{QLOG_ASYNC_MEMORY_BUDGET};
+        // 排队中的日志占用的内存
+        std::atomic<size_t> _pendingBytes{0};
+        std::atomic<uint64_t> _dropped{0};
+        // 有DropOldest的生产者入不了队, 后台线程丢弃较早的非Error日志直到积压降到一半
+        std::atomic<bool> _shedding{false};
+        // 以下只在后台线程使用
+        uint64_t _reported = 0;
+        std::chrono::steady_clock::time_point _lastReport;
+        std::chrono::steady_clock::time_point _lastMetricsReport = std::chrono::steady_clock::now();
+        std::thread _thread;
+        std::atomic<bool> _running{false};
+        // 正在push的生产者数量，stop时需要等待它们完成
+        std::atomic<uint32_t> _producers{0};
+        std::atomic<bool> _sleeping{false};
+        std::mutex _mtxWake;
+        std::condition_variable _cvWake;
+        // 保证start/stop互斥
+        std::mutex _mtxControl;
+    };
+
+    // 崩溃处理, 需要时调用install开启。收到SIGSEGV、SIGABRT、SIGBUS、SIGFPE、SIGILL时，只用异步信号安全的函数
+    // 把各appender缓冲区里的日志写出去, 再写一行FATAL日志和调用栈, 然后交给原来的处理方式(默认是终止进程并生成core)。
+    // 异步队列里还没有格式化的日志会丢失。Windows上不支持。
+    class CrashHandler
+    {
+    public:
+        // 重复调用没有影响, 不支持的平台返回false
+        static bool install();
+        // 恢复原来的处理方式
+        static void uninstall();
+        // 写完整个缓冲区, 异步信号安全
+        static void writeAll(int fd, const char* data, size_t size);
+
+    private:
+#ifndef QLOG_WINDOWS
+        static void handle(int signal, siginfo_t* info, void* context);
+        // 拼出FATAL那一行, 不申请内存
+        static size_t formatMessage(char* out, size_t capacity, int signal, const void* address);
+#endif
+
+    private:
+        inline static std::atomic<bool> _installed{false};
+        // 已经在处理了, 处理过程中再次崩溃时直接交给原来的处理方式
+        inline static std::atomic<bool> _handling{false};
+        inline static AppenderRegistry* _registry = nullptr;
+#ifndef QLOG_WINDOWS
+        static constexpr int SIGNALS[] = {SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL};
+        static constexpr int MAX_FRAMES = 64;
+        inline static struct sigaction _previous[std::size(SIGNALS)] = {};
+#endif
+    };
+
+    // 运行指标, 写日志时只有relaxed原子操作, 读取时汇总成快照。
+    class Metrics
+    {
+    public:
+        struct AppenderStats
+        {
+            uint64_t events = 0;
+            uint64_t filtered = 0;
+            uint64_t dropped = 0;
+            uint64_t bytes = 0;
+            uint64_t rotations = 0;
+            LatencyHistogram::Summary format;
+            LatencyHistogram::Summary flush;
+            LatencyHistogram::Summary lockWait;
+        };
+        struct Snapshot
+        {
+            // 分发的日志数
+            uint64_t events = 0;
+            // 没有任何appender要写的日志数
+            uint64_t filtered = 0;
+            // 异步队列积压时丢弃的日志数
+            uint64_t dropped = 0;
+            // 异步队列中排队的日志占用的内存
+            uint64_t pendingBytes = 0;
+            std::map<std::string, AppenderStats> appenders;
+            // 输出为一行, 耗时为p50/p99/max纳秒
+            std::string toString() const;
+        };
+
+        Snapshot snapshot();
+        // 是否统计耗时, 关闭后只剩计数器, 默认开启
+        static void setTiming(bool enable) { _timing.store(enable, std::memory_order_relaxed); }
+        static bool timing() { return _timing.load(std::memory_order_relaxed); }
+        // 单调时钟, 纳秒
+        static uint64_t now();
+        // 异步模式下后台线程每隔interval把toString()写成一条Info日志, 0为关闭(默认)
+        void setReportInterval(std::chrono::milliseconds interval) { _reportInterval.store(interval.count(), std::memory_order_relaxed); }
+        std::chrono::milliseconds reportInterval() const { return std::chrono::milliseconds(_reportInterval.load(std::memory_order_relaxed)); }
+        static Metrics& instance();
+
+    private:
+        friend class AppenderRegistry;
+        Metrics() = default;
+
+    private:
+        std::atomic<uint64_t> _events{0};
+        std::atomic<uint64_t> _filtered{0};
+        std::atomic<int64_t> _reportInterval{0};
+        static inline std::atomic<bool> _timing{true};
+    };
+
+    // std::map<std::string, Appender::Ptr> AppenderRegistry::_appenders;
+    //////////////////////////   实现代码   ///////////////////
+    // =============    Logger    ============
+    inline Logger::Logger(std::string_view file, uint32_t line, Level level, std::list<std::string> appenders /*= {}*/)
+        : Logger("global", file, line, level, appenders)
 
     { }
 
-    inline Logger::Logger(const std::string& key, const std::string& file, uint32_t line, Level level, std::list<std::string> appenders)
+    inline Logger::Logger(std::string_view file, uint32_t line, Level level, AppenderMask appenders)
+        : Logger("global", file, line, level)
+    {
+        _logEvent->appenders = appenders;
+    }
+
+    inline Logger::Logger(std::string_view key, std::string_view file, uint32_t line, Level level, std::list<std::string> appenders)
     {
         using namespace std::chrono;
-        _logEvent = std::make_shared<Event>();
-        _appenders = appenders;
+        _logEvent = Event::create();
+        if (!appenders.empty()) {
+            _logEvent->appenders = AppenderRegistry::instance().mask(appenders);
+        }
         _logEvent->level = level;
         _logEvent->line = line;
         _logEvent->file = file;
-        _logEvent->key = key.empty() ? "global" : key;
-
-        _logEvent->time = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+        if (!key.empty() && key != "global") {
+            _logEvent->setKey(key);
+        }
 
-        auto tid = std::this_thread::get_id();
-        _logEvent->threadId = (*(uint32_t*)&tid);;
+        Clock::stamp(*_logEvent);
+        _logEvent->threadId = currentThreadId();
+        _logEvent->threadName = currentThreadName();
     }
 
     inline Logger::~Logger()
@@ -392,29 +1676,14 @@ namespace ray::log
 
     inline void Logger::flush()
     {
-        if (_logEvent->content.str().empty()) {
+        if (_logEvent->empty()) {
             return;
         }
-        if (_appenders.empty()) {
-            _appenders = DEFAULT_APPENDERS;
-        }
-
-        for (auto key : _appenders) {
-            if (key.empty()) {
-                continue;
-            }
-            // 如果关闭控制台输出
-            if constexpr (DISABLE_CONSOLE) {
-                if (key == "console") {
-                    continue;
-                }
-            }
-            if (auto appender = AppenderRegistry::instance().get(key)) {
-                if (_logEvent->level >= appender->level()) {
-                    appender->write(_logEvent);
-                }
-            }
+        // 异步模式下只入队，格式化和IO在后台线程
+        if (AsyncWorker::instance().push(_logEvent)) {
+            return;
         }
+        AppenderRegistry::instance().dispatch(_logEvent);
     }
 
     inline ray::log::Logger& Logger::operator()(Level level)
@@ -443,27 +1712,588 @@ namespace ray::log
             QDateTime::fromMSecsSinceEpoch(logEvent->time).toString("yyyy-MM-dd hh:mm:ss.zzz").toStdString().c_str(),
             logEvent->threadId,
             logEvent->code,
-            Utils::getFilename(logEvent->file).c_str(),
+            std::string(Utils::getFilename(logEvent->file)).c_str(),
             logEvent->line);
+        std::string result;
+        result.reserve(logHead.size() + logEvent->content.size());
+        result.append(logHead).append(logEvent->content.view());
+        return result;
 #else
-        const auto sec = logEvent->time / 1000;
-        std::tm* time = std::gmtime(&sec);
-        int year = time->tm_year + 1900;
-        int month = time->tm_mon + 1;
-        int day = time->tm_mday;
-        const auto& logHead = std::format("[{0}][{1}-{2:02d}-{3:02d} {4:02d}:{5:02d}:{6:02d}][{7}][{8}:{9}] ",
-            Utils::levelToString(logEvent->level),
-            1900 + time->tm_year,
-            time->tm_mon + 1,
-            time->tm_mday,
-            time->tm_hour,
-            time->tm_min,
-            time->tm_sec,
-            logEvent->threadId,
-            Utils::getFilename(logEvent->file),
-            logEvent->line);
+        std::string result;
+        formatDefault(logEvent, result);
+        return result;
+#endif
+    }
+
+    inline void Formatter::formatTo(const Event::Ptr& logEvent, std::string& out)
+    {
+#ifndef USE_QT
+        if (typeid(*this) == typeid(Formatter)) {
+            formatDefault(logEvent, out);
+            return;
+        }
+#endif
+        out += format(logEvent);
+    }
+
+    inline void Formatter::formatDefault(const Event::Ptr& logEvent, std::string& out)
+    {
+        // [level][date][tid][file:line] content, 线程有名字时为[tid name]
+        char digits[32];
+        out += '[';
+        out += Utils::levelToString(logEvent->level);
+        out += "][";
+        appendDateTime(out, logEvent->timeNs, _precision);
+        out += "][";
+        out.append(digits, std::to_chars(digits, digits + sizeof(digits), logEvent->threadId).ptr);
+        if (!logEvent->threadName.empty()) {
+            out += ' ';
+            out += logEvent->threadName;
+        }
+        out += "][";
+        out += Utils::getFilename(logEvent->file);
+        out += ':';
+        out.append(digits, std::to_chars(digits, digits + sizeof(digits), logEvent->line).ptr);
+        out += "] ";
+        out += logEvent->content.view();
+        // 结构化字段追加为 key=value
+        logEvent->fields.forEach([&](std::string_view key, const Fields::Value& value) {
+            out += ' ';
+            out += key;
+            out += '=';
+            switch (value.type) {
+            case Fields::Type::Int: out.append(digits, std::to_chars(digits, digits + sizeof(digits), value.i).ptr); break;
+            case Fields::Type::UInt: out.append(digits, std::to_chars(digits, digits + sizeof(digits), value.u).ptr); break;
+            case Fields::Type::Double: out.append(digits, std::to_chars(digits, digits + sizeof(digits), value.d).ptr); break;
+            case Fields::Type::Bool: out += value.b ? "true" : "false"; break;
+            case Fields::Type::String: out += value.s; break;
+            }
+        });
+    }
+
+    inline void Formatter::appendDateTime(std::string& out, int64_t timeNs, Precision precision)
+    {
+        constexpr int64_t NS_PER_SEC = 1000000000;
+        // 按UTC计算，与之前的gmtime一致
+        struct Cache
+        {
+            int64_t second = INT64_MIN;
+            // YYYY-MM-DD hh:mm:ss
+            char text[32] = {};
+            size_t length = 0;
+            // 日期部分的长度
+            size_t dateLength = 0;
+        };
+        thread_local Cache cache;
+        auto write2 = [](char* p, int64_t v) {
+            p[0] = static_cast<char>('0' + v / 10);
+            p[1] = static_cast<char>('0' + v % 10);
+        };
+        int64_t second = timeNs / NS_PER_SEC;
+        int64_t fraction = timeNs % NS_PER_SEC;
+        if (fraction < 0) {
+            --second;
+            fraction += NS_PER_SEC;
+        }
+        if (second != cache.second) {
+            if (cache.second != INT64_MIN && second / 60 == cache.second / 60 && second >= 0) {
+                // 同一分钟只改秒
+                write2(cache.text + cache.length - 2, second % 60);
+            }
+            else if (cache.second != INT64_MIN && second / 86400 == cache.second / 86400 && second >= 0) {
+                // 同一天只改时分秒
+                const int64_t daySecond = second % 86400;
+                char* p = cache.text + cache.dateLength + 1;
+                write2(p, daySecond / 3600);
+                write2(p + 3, daySecond / 60 % 60);
+                write2(p + 6, daySecond % 60);
+            }
+            else {
+                const std::time_t sec = static_cast<std::time_t>(second);
+                std::tm time{};
+                gmtime_r(&sec, &time);
+                const auto result = std::format_to_n(cache.text, sizeof(cache.text) - 1, "{}-{:02d}-{:02d} {:02d}:{:02d}:{:02d}",
+                    1900 + time.tm_year,
+                    time.tm_mon + 1,
+                    time.tm_mday,
+                    time.tm_hour,
+                    time.tm_min,
+                    time.tm_sec);
+                cache.length = static_cast<size_t>(result.out - cache.text);
+                cache.dateLength = cache.length - 9;
+            }
+            cache.second = second;
+        }
+        out.append(cache.text, cache.length);
+        if (precision == Precision::Seconds) {
+            return;
+        }
+        // 小数部分直接按位写
+        int digits = 9;
+        int64_t value = fraction;
+        if (precision == Precision::Milliseconds) {
+            digits = 3;
+            value /= 1000000;
+        }
+        else if (precision == Precision::Microseconds) {
+            digits = 6;
+            value /= 1000;
+        }
+        char buf[12];
+        buf[0] = '.';
+        for (int i = digits; i > 0; --i) {
+            buf[i] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        }
+        out.append(buf, static_cast<size_t>(digits + 1));
+    }
+
+    // =========================  JsonFormatter
+    inline std::string JsonFormatter::format(Event::Ptr logEvent)
+    {
+        std::string result;
+        formatTo(logEvent, result);
+        return result;
+    }
+
+    inline void JsonFormatter::formatTo(const Event::Ptr& logEvent, std::string& out)
+    {
+        static constexpr std::string_view LEVELS[] = {"UNKNOWN", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"};
+        char digits[32];
+        auto appendNumber = [&](auto value) { out.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr); };
+        auto appendString = [&](std::string_view text) {
+            out += '"';
+            appendEscaped(out, text);
+            out += '"';
+        };
+        out += "{\"time\":\"";
+        // ISO 8601: 日期和时间之间用T, 以Z结尾
+        const size_t dateTime = out.size();
+        appendDateTime(out, logEvent->timeNs, precision());
+        out[dateTime + 10] = 'T';
+        out += "Z\",\"level\":\"";
+        const auto level = static_cast<size_t>(logEvent->level);
+        out += level < std::size(LEVELS) ? LEVELS[level] : LEVELS[0];
+        out += "\",\"thread\":";
+        appendNumber(logEvent->threadId);
+        if (!logEvent->threadName.empty()) {
+            out += ",\"thread_name\":";
+            appendString(logEvent->threadName);
+        }
+        out += ",\"file\":";
+        appendString(Utils::getFilename(logEvent->file));
+        out += ",\"line\":";
+        appendNumber(logEvent->line);
+        if (logEvent->code != 0) {
+            out += ",\"code\":";
+            appendNumber(logEvent->code);
+        }
+        out += ",\"key\":";
+        appendString(logEvent->key);
+        out += ",\"message\":";
+        appendString(logEvent->content.view());
+        if (!logEvent->fields.empty()) {
+            out += ",\"fields\":{";
+            bool first = true;
+            logEvent->fields.forEach([&](std::string_view key, const Fields::Value& value) {
+                if (!first) {
+                    out += ',';
+                }
+                first = false;
+                appendString(key);
+                out += ':';
+                switch (value.type) {
+                case Fields::Type::Int: appendNumber(value.i); break;
+                case Fields::Type::UInt: appendNumber(value.u); break;
+                case Fields::Type::Double:
+                    // JSON里没有NaN和无穷大
+                    if (std::isfinite(value.d)) {
+                        appendNumber(value.d);
+                    }
+                    else {
+                        out += "null";
+                    }
+                    break;
+                case Fields::Type::Bool: out += value.b ? "true" : "false"; break;
+                case Fields::Type::String: appendString(value.s); break;
+                }
+            });
+            out += '}';
+        }
+        out += '}';
+    }
+
+    inline void JsonFormatter::appendEscaped(std::string& out, std::string_view text)
+    {
+        static constexpr char HEX[] = "0123456789abcdef";
+        size_t start = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            const auto c = static_cast<unsigned char>(text[i]);
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                continue;
+            }
+            // 不需要转义的部分整段追加
+            out.append(text.data() + start, i - start);
+            start = i + 1;
+            out += '\\';
+            switch (c) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '\n': out += 'n'; break;
+            case '\r': out += 'r'; break;
+            case '\t': out += 't'; break;
+            case '\b': out += 'b'; break;
+            case '\f': out += 'f'; break;
+            default:
+                out += "u00";
+                out += HEX[c >> 4];
+                out += HEX[c & 0xF];
+                break;
+            }
+        }
+        out.append(text.data() + start, text.size() - start);
+    }
+
+    // =========================  PatternFormatter
+    inline PatternFormatter::PatternFormatter(std::string_view pattern)
+    {
+        // 最常见的日期时间写法合成一步
+        constexpr std::string_view DATE_TIME = "%Y-%m-%d %H:%M:%S";
+        size_t i = 0;
+        while (i < pattern.size()) {
+            if (pattern.substr(i, DATE_TIME.size()) == DATE_TIME) {
+                _steps.push_back({Op::DateTime});
+                i += DATE_TIME.size();
+                continue;
+            }
+            if (pattern[i] != '%' || i + 1 == pattern.size()) {
+                const size_t end = std::min(pattern.find('%', i + 1), pattern.size());
+                addLiteral(pattern.substr(i, end - i));
+                i = end;
+                continue;
+            }
+            const char flag = pattern[i + 1];
+            i += 2;
+            switch (flag) {
+            case 'D':
+                _steps.push_back({Op::Year});
+                addLiteral("-");
+                _steps.push_back({Op::Month});
+                addLiteral("-");
+                _steps.push_back({Op::Day});
+                break;
+            case 'T':
+                _steps.push_back({Op::Hour});
+                addLiteral(":");
+                _steps.push_back({Op::Minute});
+                addLiteral(":");
+                _steps.push_back({Op::Second});
+                break;
+            case 'Y': _steps.push_back({Op::Year}); break;
+            case 'm': _steps.push_back({Op::Month}); break;
+            case 'd': _steps.push_back({Op::Day}); break;
+            case 'H': _steps.push_back({Op::Hour}); break;
+            case 'M': _steps.push_back({Op::Minute}); break;
+            case 'S': _steps.push_back({Op::Second}); break;
+            case 'e': _steps.push_back({Op::Millis}); break;
+            case 'f': _steps.push_back({Op::Micros}); break;
+            case 'F': _steps.push_back({Op::Nanos}); break;
+            case 'l': _steps.push_back({Op::Level}); break;
+            case 'L': _steps.push_back({Op::ShortLevel}); break;
+            case 't': _steps.push_back({Op::Thread}); break;
+            case 'N': _steps.push_back({Op::ThreadName}); break;
+            case 's': _steps.push_back({Op::File}); break;
+            case '#': _steps.push_back({Op::Line}); break;
+            case 'n': _steps.push_back({Op::Key}); break;
+            case 'q': _steps.push_back({Op::Code}); break;
+            case 'v': _steps.push_back({Op::Message}); break;
+            case '%': addLiteral("%"); break;
+            default: addLiteral(pattern.substr(i - 2, 2)); break;
+            }
+        }
+        for (const auto& step : _steps) {
+            if (step.op >= Op::Year && step.op <= Op::Second) {
+                _needTm = true;
+            }
+        }
+    }
+
+    inline void PatternFormatter::addLiteral(std::string_view text)
+    {
+        // 相邻的字面量合并
+        if (!_steps.empty() && _steps.back().op == Op::Literal && _steps.back().offset + _steps.back().length == _literals.size()) {
+            _steps.back().length += static_cast<uint32_t>(text.size());
+        }
+        else {
+            _steps.push_back({Op::Literal, static_cast<uint32_t>(_literals.size()), static_cast<uint32_t>(text.size())});
+        }
+        _literals += text;
+    }
+
+    inline std::string PatternFormatter::format(Event::Ptr logEvent)
+    {
+        std::string result;
+        formatTo(logEvent, result);
+        return result;
+    }
+
+    inline void PatternFormatter::formatTo(const Event::Ptr& logEvent, std::string& out)
+    {
+        constexpr int64_t NS_PER_SEC = 1000000000;
+        int64_t second = logEvent->timeNs / NS_PER_SEC;
+        int64_t fraction = logEvent->timeNs % NS_PER_SEC;
+        if (fraction < 0) {
+            --second;
+            fraction += NS_PER_SEC;
+        }
+        // 同一秒内的日志复用分解好的时间
+        thread_local int64_t cachedSecond = INT64_MIN;
+        thread_local std::tm tm{};
+        if (_needTm && second != cachedSecond) {
+            const std::time_t sec = static_cast<std::time_t>(second);
+            gmtime_r(&sec, &tm);
+            cachedSecond = second;
+        }
+        char digits[24];
+        auto appendNumber = [&](auto value) { out.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr); };
+        auto appendPadded = [&](int64_t value, int width) {
+            for (int i = width - 1; i >= 0; --i) {
+                digits[i] = static_cast<char>('0' + value % 10);
+                value /= 10;
+            }
+            out.append(digits, static_cast<size_t>(width));
+        };
+        for (const auto& step : _steps) {
+            switch (step.op) {
+            case Op::Literal: out.append(_literals, step.offset, step.length); break;
+            case Op::DateTime: appendDateTime(out, logEvent->timeNs, Precision::Seconds); break;
+            case Op::Year: appendNumber(tm.tm_year + 1900); break;
+            case Op::Month: appendPadded(tm.tm_mon + 1, 2); break;
+            case Op::Day: appendPadded(tm.tm_mday, 2); break;
+            case Op::Hour: appendPadded(tm.tm_hour, 2); break;
+            case Op::Minute: appendPadded(tm.tm_min, 2); break;
+            case Op::Second: appendPadded(tm.tm_sec, 2); break;
+            case Op::Millis: appendPadded(fraction / 1000000, 3); break;
+            case Op::Micros: appendPadded(fraction / 1000, 6); break;
+            case Op::Nanos: appendPadded(fraction, 9); break;
+            case Op::Level: out += Utils::levelToString(logEvent->level); break;
+            case Op::ShortLevel: out += Utils::levelToString(logEvent->level).front(); break;
+            case Op::Thread: appendNumber(logEvent->threadId); break;
+            case Op::ThreadName:
+                if (logEvent->threadName.empty()) {
+                    appendNumber(logEvent->threadId);
+                }
+                else {
+                    out += logEvent->threadName;
+                }
+                break;
+            case Op::File: out += Utils::getFilename(logEvent->file); break;
+            case Op::Line: appendNumber(logEvent->line); break;
+            case Op::Key: out += logEvent->key; break;
+            case Op::Code: appendNumber(logEvent->code); break;
+            case Op::Message: out += logEvent->content.view(); break;
+            }
+        }
+    }
+
+    //=========================    Clock
+    inline void Clock::setSource(ClockSource source)
+    {
+        if (source == ClockSource::Tsc) {
+            if (!tscAvailable()) {
+                source = ClockSource::System;
+            }
+            else {
+                while (_calibrating.test_and_set(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                calibrate(true);
+                _calibrating.clear(std::memory_order_release);
+            }
+        }
+        _source.store(source, std::memory_order_relaxed);
+    }
+
+    inline void Clock::stamp(Event& event)
+    {
+        const ClockSource source = _source.load(std::memory_order_relaxed);
+        if (source == ClockSource::Tsc) {
+            event.ticks = readTsc();
+            return;
+        }
+        int64_t ns;
+#ifdef __linux__
+        if (source == ClockSource::Coarse) {
+            timespec ts;
+            ::clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+            ns = static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+        }
+        else {
+            ns = systemNow();
+        }
+#else
+        ns = systemNow();
+#endif
+        event.timeNs = ns;
+        event.time = ns / 1000000;
+    }
+
+    inline int64_t Clock::toNanoseconds(uint64_t ticks)
+    {
+        uint32_t sequence;
+        uint64_t baseTicks;
+        int64_t baseNs;
+        double nsPerTick;
+        while (true) {
+            // 读到新写的字段时, 之后读序号一定能看到写之前改的序号
+            sequence = _sequence.load(std::memory_order_acquire);
+            baseTicks = _baseTicks.load(std::memory_order_acquire);
+            baseNs = _baseNs.load(std::memory_order_acquire);
+            nsPerTick = _nsPerTick.load(std::memory_order_acquire);
+            if ((sequence & 1) == 0 && sequence == _sequence.load(std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        // 事件可能在校准之前取的计数, 差值按有符号计算
+        const double elapsed = static_cast<double>(static_cast<int64_t>(ticks - baseTicks)) * nsPerTick;
+        if (elapsed > CALIBRATE_INTERVAL && !_calibrating.test_and_set(std::memory_order_acquire)) {
+            calibrate(false);
+            _calibrating.clear(std::memory_order_release);
+            return toNanoseconds(ticks);
+        }
+        return baseNs + static_cast<int64_t>(elapsed);
+    }
+
+    inline bool Clock::tscAvailable()
+    {
+#if QLOG_HAS_TSC
+        // CPUID 0x80000007 EDX第8位: 不变TSC
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 0x80000000);
+        if (static_cast<unsigned>(info[0]) < 0x80000007u) {
+            return false;
+        }
+        __cpuid(info, 0x80000007);
+        return (info[3] & (1 << 8)) != 0;
+#else
+        unsigned a, b, c, d;
+        return __get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1u << 8)) != 0;
+#endif
+#else
+        return false;
+#endif
+    }
+
+    inline uint64_t Clock::readTsc()
+    {
+#if QLOG_HAS_TSC
+        return __rdtsc();
+#else
+        return 0;
+#endif
+    }
+
+    inline int64_t Clock::systemNow()
+    {
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+    }
+
+    inline void Clock::samplePair(uint64_t& ticks, int64_t& ns)
+    {
+        // 取系统时间前后各读一次TSC, 用间隔最小的一次的中点
+        uint64_t best = UINT64_MAX;
+        for (int i = 0; i < 5; ++i) {
+            const uint64_t before = readTsc();
+            const int64_t now = systemNow();
+            const uint64_t after = readTsc();
+            if (after - before < best) {
+                best = after - before;
+                ticks = before + (after - before) / 2;
+                ns = now;
+            }
+        }
+    }
+
+    inline void Clock::calibrate(bool initial)
+    {
+        uint64_t ticks = 0;
+        int64_t ns = 0;
+        double nsPerTick = _nsPerTick.load(std::memory_order_relaxed);
+        if (initial) {
+            samplePair(_anchorTicks, _anchorNs);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            samplePair(ticks, ns);
+            nsPerTick = static_cast<double>(ns - _anchorNs) / static_cast<double>(ticks - _anchorTicks);
+        }
+        else {
+            samplePair(ticks, ns);
+            // 时间差越长频率越准; 系统时间被调整过(偏差超过0.1%)时从这里重新开始计算
+            const double measured = static_cast<double>(ns - _anchorNs) / static_cast<double>(ticks - _anchorTicks);
+            if (std::abs(measured - nsPerTick) <= nsPerTick / 1000) {
+                nsPerTick = measured;
+            }
+            else {
+                _anchorTicks = ticks;
+                _anchorNs = ns;
+            }
+        }
+        const uint32_t sequence = _sequence.load(std::memory_order_relaxed);
+        _sequence.store(sequence + 1, std::memory_order_relaxed);
+        _baseTicks.store(ticks, std::memory_order_release);
+        _baseNs.store(ns, std::memory_order_release);
+        _nsPerTick.store(nsPerTick, std::memory_order_release);
+        _sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    //=========================    thread
+    inline uint32_t currentThreadId()
+    {
+        thread_local const uint32_t id = [] {
+#ifdef QLOG_WINDOWS
+            return static_cast<uint32_t>(::GetCurrentThreadId());
+#elif defined(__linux__)
+            return static_cast<uint32_t>(::syscall(SYS_gettid));
+#else
+            // 没有系统线程ID时用std::thread::id的哈希
+            return static_cast<uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id()));
+#endif
+        }();
+        return id;
+    }
+
+    // 当前线程名的存储, 只在setThreadName和currentThreadName中使用
+    inline std::string_view& threadNameSlot()
+    {
+        thread_local std::string_view name;
+        return name;
+    }
+
+    inline void setThreadName(std::string_view name)
+    {
+        // 名字存到全局的集合里, 不释放也不析构, 线程退出后队列里的日志还在引用它
+        static std::mutex mutex;
+        static auto* names = new std::set<std::string, std::less<>>;
+        {
+            std::lock_guard lock(mutex);
+            auto it = names->find(name);
+            if (it == names->end()) {
+                it = names->emplace(name).first;
+            }
+            threadNameSlot() = *it;
+        }
+#ifdef __linux__
+        // 系统线程名最长15个字符
+        char buffer[16] = {};
+        std::memcpy(buffer, name.data(), std::min(name.size(), sizeof(buffer) - 1));
+        ::pthread_setname_np(::pthread_self(), buffer);
 #endif
-        return logHead + logEvent->content.str();
+    }
+
+    inline std::string_view currentThreadName()
+    {
+        return threadNameSlot();
     }
 
     //=========================    Utils
@@ -480,7 +2310,7 @@ namespace ray::log
         return "Unknown";
     }
 
-    inline std::string Utils::getFilename(const std::string& filepath)
+    inline std::string_view Utils::getFilename(std::string_view filepath)
     {
         auto pos = filepath.find_last_of("/");
         if (pos == filepath.npos) {
@@ -507,6 +2337,24 @@ namespace ray::log
                 [] {
                     return std::make_shared<FileAppender>();
                 }
+            },
+            {
+                "ring",
+                [] {
+                    return std::make_shared<RingFileAppender>();
+                }
+            },
+            {
+                "binary",
+                [] {
+                    return std::make_shared<BinaryFileAppender>();
+                }
+            },
+            {
+                "routing",
+                [] {
+                    return std::make_shared<RoutingFileAppender>();
+                }
             }
             // add your appenders through registerCreateMethod
         };
@@ -549,37 +2397,436 @@ namespace ray::log
     //  // clear();
     //}
 
-    inline void ray::log::AppenderRegistry::addAppenders(std::list<std::string> appenders)
+    inline AppenderRegistry::~AppenderRegistry()
     {
-        std::unique_lock<std::shared_mutex> lock(AppenderRegistry::_mutex);
-        for (const auto& name : appenders) {
-            if (auto appender = AppenderFactory::instance().create(name)) {
-                _appenders[name] = appender;
-            }
-        }
+        delete _snapshot.load();
     }
 
-    inline void AppenderRegistry::clear()
+    inline uint32_t AppenderRegistry::handle(const std::string& name)
     {
-        std::lock_guard<std::shared_mutex> lock(AppenderRegistry::_mutex);
-        _appenders.clear();
+        auto it = _handles.find(name);
+        if (it != _handles.end()) {
+            return it->second;
+        }
+        if (_handles.size() >= MAX_APPENDERS) {
+            return MAX_APPENDERS;
+        }
+        const auto index = static_cast<uint32_t>(_handles.size());
+        _handles[name] = index;
+        return index;
     }
 
-    inline const Appender::Ptr AppenderRegistry::get(const std::string& name)
+    inline AppenderMask AppenderRegistry::mask(const std::list<std::string>& names)
     {
-        // 这里提前创建好就不用加锁了
-        // 延迟加载，多线程下不安全，加锁的话影响性能
-        // if (_appenders.find(name) == _appenders.end()) {
-        //  _appenders[name] = AppenderFactory::create(name);
-        //}
-        std::shared_lock<std::shared_mutex> lockShared(AppenderRegistry::_mutex);
-        // call addAppenders first
-        if (_appenders.find(name) == _appenders.end()) {
+        AppenderMask bits = 0;
+        {
+            // 每条日志都可能调用, 名字都已经分配过位时只需要读锁
+            std::shared_lock<std::shared_mutex> lockShared(AppenderRegistry::_mutex);
+            bool known = true;
+            for (const auto& name : names) {
+                if (name.empty()) {
+                    continue;
+                }
+                const auto it = _handles.find(name);
+                if (it == _handles.end()) {
+                    known = false;
+                    break;
+                }
+                bits |= AppenderMask(1) << it->second;
+            }
+            if (known) {
+                return bits;
+            }
+        }
+        bits = 0;
+        std::unique_lock<std::shared_mutex> lock(AppenderRegistry::_mutex);
+        for (const auto& name : names) {
+            if (name.empty()) {
+                continue;
+            }
+            const auto index = handle(name);
+            if (index < MAX_APPENDERS) {
+                bits |= AppenderMask(1) << index;
+            }
+        }
+        return bits;
+    }
+
+    inline AppenderMask AppenderRegistry::defaultMask()
+    {
+        AppenderMask bits = _defaultMask.load(std::memory_order_relaxed);
+        if (bits == 0) {
+            bits = mask(DEFAULT_APPENDERS);
+            _defaultMask.store(bits, std::memory_order_relaxed);
+        }
+        return bits;
+    }
+
+    inline void AppenderRegistry::publish()
+    {
+        auto snapshot = std::make_unique<Snapshot>();
+        for (const auto& [name, appender] : _appenders) {
+            // 如果关闭控制台输出
+            if constexpr (DISABLE_CONSOLE) {
+                if (name == "console") {
+                    continue;
+                }
+            }
+            const auto index = handle(name);
+            if (index < MAX_APPENDERS) {
+                snapshot->appenders[index] = appender;
+            }
+        }
+        if (auto old = _snapshot.exchange(snapshot.release(), std::memory_order_seq_cst)) {
+            _retired.emplace_back(old);
+        }
+    }
+
+    inline void AppenderRegistry::reclaim()
+    {
+        // 在dispatch里(例如appender的write)修改registry时不能等自己, 留到下一次
+        if (_readDepth > 0) {
+            return;
+        }
+        std::lock_guard reclaimLock(_mtxReclaim);
+        std::vector<std::unique_ptr<const Snapshot>> retired;
+        {
+            std::lock_guard<std::shared_mutex> lock(AppenderRegistry::_mutex);
+            retired.swap(_retired);
+        }
+        if (retired.empty()) {
+            return;
+        }
+        // 每次切换后新的读者使用另一个计数, 旧的计数只减不增; 切换两次后, 发布新快照前开始读的线程都已经离开
+        for (int phase = 0; phase < 2; ++phase) {
+            const uint64_t old = _epoch.fetch_add(1, std::memory_order_seq_cst) & 1;
+            for (auto& slot : _readers) {
+                while (slot.count[old].load(std::memory_order_seq_cst) != 0) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+        // 旧的appender在这里析构, 写出缓冲区并关闭文件
+        retired.clear();
+    }
+
+    inline AppenderRegistry::Reader::Reader(AppenderRegistry& registry)
+    {
+        ++_readDepth;
+        _count = &registry._readers[currentThreadId() % READER_SLOTS].count[registry._epoch.load(std::memory_order_relaxed) & 1];
+        // 先计数再读快照, reclaim看到计数为0时这里一定读到的是新快照
+        _count->fetch_add(1, std::memory_order_seq_cst);
+        _snapshot = registry._snapshot.load(std::memory_order_seq_cst);
+    }
+
+    inline AppenderRegistry::Reader::~Reader()
+    {
+        _count->fetch_sub(1, std::memory_order_release);
+        --_readDepth;
+    }
+
+    inline void ray::log::AppenderRegistry::addAppenders(std::list<std::string> appenders)
+    {
+        // 在锁外创建，appender的构造函数可能会调用setLevel
+        std::map<std::string, Appender::Ptr> created;
+        for (const auto& name : appenders) {
+            if (auto appender = AppenderFactory::instance().create(name)) {
+                created[name] = appender;
+            }
+        }
+        {
+            std::unique_lock<std::shared_mutex> lock(AppenderRegistry::_mutex);
+            for (auto& [name, appender] : created) {
+                _appenders[name] = std::move(appender);
+            }
+            publish();
+        }
+        reclaim();
+        updateMinLevel();
+    }
+
+    inline void AppenderRegistry::clear()
+    {
+        {
+            std::lock_guard<std::shared_mutex> lock(AppenderRegistry::_mutex);
+            _appenders.clear();
+            publish();
+        }
+        reclaim();
+        updateMinLevel();
+    }
+
+    inline void AppenderRegistry::updateMinLevel()
+    {
+        std::shared_lock<std::shared_mutex> lockShared(AppenderRegistry::_mutex);
+        // 还没有appender时不过滤
+        Level level = _appenders.empty() ? Level::Debug : Level::Fatal;
+        for (const auto& [name, appender] : _appenders) {
+            level = std::min(level, appender->level());
+        }
+        // backtrace要保存的日志不能在shouldLog处被过滤
+        if (_backtraceEnabled.load(std::memory_order_relaxed)) {
+            level = std::min(level, _backtraceLevel.load(std::memory_order_relaxed));
+        }
+        _minLevel.store(level, std::memory_order_relaxed);
+    }
+
+    inline void AppenderRegistry::enableBacktrace(size_t capacity, Level level)
+    {
+        std::vector<BacktraceEntry> old;
+        {
+            std::lock_guard lock(_mtxBacktrace);
+            _backtraceCapacity = capacity;
+            for (const auto& ring : _backtraceRings) {
+                std::lock_guard ringLock(ring->mutex);
+                std::move(ring->entries.begin(), ring->entries.end(), std::back_inserter(old));
+                ring->entries.assign(capacity, BacktraceEntry());
+                ring->next = 0;
+            }
+            _backtraceLevel.store(level, std::memory_order_relaxed);
+            _backtraceEnabled.store(capacity > 0, std::memory_order_relaxed);
+        }
+        updateMinLevel();
+    }
+
+    inline void AppenderRegistry::recordBacktrace(const Event::Ptr& event, AppenderMask pending)
+    {
+        thread_local std::shared_ptr<BacktraceRing> ring;
+        if (!ring) {
+            ring = std::make_shared<BacktraceRing>();
+            std::lock_guard lock(_mtxBacktrace);
+            ring->entries.resize(_backtraceCapacity);
+            _backtraceRings.push_back(ring);
+        }
+        // 被挤掉的事件在锁外放回对象池
+        Event::Ptr old;
+        std::lock_guard lock(ring->mutex);
+        if (ring->entries.empty()) {
+            return;
+        }
+        auto& entry = ring->entries[ring->next];
+        old = std::exchange(entry.event, event);
+        entry.pending = pending;
+        ring->next = (ring->next + 1) % ring->entries.size();
+    }
+
+    inline void AppenderRegistry::dumpBacktrace(const Snapshot* snapshot, const Event::Ptr& trigger, AppenderMask targets)
+    {
+        // 会写trigger的appender
+        AppenderMask writers = 0;
+        while (targets) {
+            const auto index = std::countr_zero(targets);
+            targets &= targets - 1;
+            const auto& appender = snapshot->appenders[index];
+            if (appender && trigger->level >= appender->level()) {
+                writers |= AppenderMask(1) << index;
+            }
+        }
+        if (writers == 0) {
+            return;
+        }
+        // 持有锁直到写完, 同一条日志不会被两个线程同时格式化
+        std::lock_guard lock(_mtxBacktrace);
+        std::vector<BacktraceEntry> entries;
+        for (auto it = _backtraceRings.begin(); it != _backtraceRings.end();) {
+            auto& ring = **it;
+            bool empty = true;
+            {
+                std::lock_guard ringLock(ring.mutex);
+                const size_t size = ring.entries.size();
+                // 从最早的开始
+                for (size_t i = 0; i < size; ++i) {
+                    auto& entry = ring.entries[(ring.next + i) % size];
+                    if (entry.pending & writers) {
+                        entries.push_back({entry.event, entry.pending & writers});
+                        entry.pending &= ~writers;
+                        if (entry.pending == 0) {
+                            entry.event.reset();
+                        }
+                    }
+                    empty = empty && !entry.event;
+                }
+            }
+            // 线程已经退出并且没有要写的了
+            if (empty && it->use_count() == 1) {
+                it = _backtraceRings.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        if (entries.empty()) {
+            return;
+        }
+        // 合并各线程的日志
+        std::stable_sort(entries.begin(), entries.end(), [](const BacktraceEntry& a, const BacktraceEntry& b) { return a.event->timeNs < b.event->timeNs; });
+        while (writers) {
+            const auto index = std::countr_zero(writers);
+            const AppenderMask bit = AppenderMask(1) << index;
+            writers &= writers - 1;
+            const auto& appender = snapshot->appenders[index];
+            // 只写这个appender当时过滤掉的
+            auto pending = [&](const BacktraceEntry& entry) { return (entry.pending & bit) != 0; };
+            const auto count = std::count_if(entries.begin(), entries.end(), pending);
+            if (count == 0) {
+                continue;
+            }
+            // 前面加一行说明, 和正常写入的日志区分开
+            auto header = Event::create();
+            header->timeNs = trigger->timeNs;
+            header->time = trigger->time;
+            header->level = Level::Info;
+            header->line = trigger->line;
+            header->file = trigger->file;
+            header->threadId = trigger->threadId;
+            header->threadName = trigger->threadName;
+            header->key = trigger->key;
+            header->formatter = trigger->formatter;
+            header->content << "backtrace: " << count << " earlier events";
+            appender->write(header);
+            for (const auto& entry : entries) {
+                if (pending(entry)) {
+                    entry.event->materialize();
+                    appender->write(entry.event);
+                }
+            }
+        }
+    }
+
+    inline const Appender::Ptr AppenderRegistry::get(const std::string& name)
+    {
+        // 这里提前创建好就不用加锁了
+        // 延迟加载，多线程下不安全，加锁的话影响性能
+        // if (_appenders.find(name) == _appenders.end()) {
+        //  _appenders[name] = AppenderFactory::create(name);
+        //}
+        std::shared_lock<std::shared_mutex> lockShared(AppenderRegistry::_mutex);
+        // call addAppenders first
+        if (_appenders.find(name) == _appenders.end()) {
             return nullptr;
         }
         return _appenders[name];
     }
 
+    inline void AppenderRegistry::dispatch(const Event::Ptr& event)
+    {
+        Reader reader(*this);
+        const Snapshot* snapshot = reader.snapshot();
+        if (!snapshot) {
+            return;
+        }
+        event->resolveTime();
+        AppenderMask bits = event->appenders ? event->appenders : defaultMask();
+        if (event->level >= Level::Error && _backtraceEnabled.load(std::memory_order_relaxed)) {
+            dumpBacktrace(snapshot, event, bits);
+        }
+        bool materialized = false;
+        AppenderMask filtered = 0;
+        while (bits) {
+            const auto index = std::countr_zero(bits);
+            bits &= bits - 1;
+            const auto& appender = snapshot->appenders[index];
+            if (!appender) {
+                continue;
+            }
+            if (event->level >= appender->level()) {
+                // 只有真正要写的时候才格式化
+                if (!materialized) {
+                    event->materialize();
+                    materialized = true;
+                }
+                appender->write(event);
+            }
+            else {
+                appender->_metrics.filtered.fetch_add(1, std::memory_order_relaxed);
+                filtered |= AppenderMask(1) << index;
+            }
+        }
+        // 所有appender都处理完再保存, 之后只有取出它的线程会格式化
+        if (filtered && _backtraceEnabled.load(std::memory_order_relaxed) && event->level >= _backtraceLevel.load(std::memory_order_relaxed)) {
+            recordBacktrace(event, filtered);
+        }
+        // 同步模式没有后台线程调用idle, 重复的日志停了以后靠后面的日志检查超时
+        if (_pendingRepeats.load(std::memory_order_relaxed) > 0 && !AsyncWorker::instance().running()) {
+            for (const auto& appender : snapshot->appenders) {
+                if (appender) {
+                    appender->expireRepeats();
+                }
+            }
+        }
+        // 同样, 限流位置的丢弃数量也靠后面的日志写出
+        if (LogSite::hasSuppressed() && !AsyncWorker::instance().running()) {
+            LogSite::reportSuppressed();
+        }
+        auto& metrics = Metrics::instance();
+        metrics._events.fetch_add(1, std::memory_order_relaxed);
+        if (!materialized) {
+            metrics._filtered.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    inline std::map<std::string, Appender::Ptr> AppenderRegistry::appenders()
+    {
+        std::shared_lock<std::shared_mutex> lockShared(AppenderRegistry::_mutex);
+        return _appenders;
+    }
+
+    inline void AppenderRegistry::crash(std::string_view message, void* const* frames, int depth)
+    {
+        // 信号处理函数里不能用Reader, 快照在这期间被reclaim释放的可能只能忽略
+        if (const Snapshot* snapshot = _snapshot.load(std::memory_order_acquire)) {
+            for (const auto& appender : snapshot->appenders) {
+                if (appender) {
+                    appender->onCrash(message, frames, depth);
+                }
+            }
+        }
+    }
+
+    inline std::optional<OverflowPolicy> AppenderRegistry::overflowPolicy(const Event::Ptr& event)
+    {
+        std::optional<OverflowPolicy> policy;
+        Reader reader(*this);
+        const Snapshot* snapshot = reader.snapshot();
+        if (!snapshot) {
+            return policy;
+        }
+        AppenderMask bits = event->appenders ? event->appenders : defaultMask();
+        bool filtered = false;
+        while (bits) {
+            const auto index = std::countr_zero(bits);
+            bits &= bits - 1;
+            const auto& appender = snapshot->appenders[index];
+            if (!appender) {
+                continue;
+            }
+            // 不会写这条日志的appender不参与
+            if (event->level >= appender->level()) {
+                policy = std::max(policy.value_or(OverflowPolicy::DropNewest), appender->overflowPolicy());
+            }
+            else {
+                filtered = true;
+            }
+        }
+        // 只为backtrace保存的日志不值得阻塞业务线程, 积压时丢弃, 但要计入丢弃数量
+        if (!policy && filtered && _backtraceEnabled.load(std::memory_order_relaxed) && event->level >= _backtraceLevel.load(std::memory_order_relaxed)) {
+            policy = OverflowPolicy::DropNewest;
+        }
+        return policy;
+    }
+
+    inline void AppenderRegistry::idle(bool final)
+    {
+        Reader reader(*this);
+        if (const Snapshot* snapshot = reader.snapshot()) {
+            for (const auto& appender : snapshot->appenders) {
+                if (appender) {
+                    appender->idle(final);
+                }
+            }
+        }
+    }
+
     // std::list<std::string> AppenderRegistry::keys()
     //{
     //  std::list<std::string> keys;
@@ -589,177 +2836,2341 @@ namespace ray::log
     //  return keys;
     // }
 
-    // =============================          appenders
-    inline bool Appender::write(Event::Ptr event)
+    // =============================          crash
+    inline void CrashHandler::writeAll(int fd, const char* data, size_t size)
     {
-        std::lock_guard lock(_mtxFlush);
-        return flush(event);
+        while (size > 0) {
+#ifdef QLOG_WINDOWS
+            const auto n = ::_write(fd, data, static_cast<unsigned int>(size));
+#else
+            const auto n = ::write(fd, data, size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+#endif
+            if (n <= 0) {
+                return;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
     }
 
-    inline Formatter::Ptr Appender::getFormatter(Event::Ptr event)
+#ifdef QLOG_WINDOWS
+    inline bool CrashHandler::install()
     {
-        if (!event->formatter && !_formatter) {
-            _formatter = std::make_shared<Formatter>();
-        }
-        return (event->formatter ? event->formatter : _formatter);
+        return false;
     }
 
-    inline bool ConsoleAppender::flush(Event::Ptr event)
+    inline void CrashHandler::uninstall() { }
+#else
+    inline bool CrashHandler::install()
     {
-        auto formatter = getFormatter(event);
-#ifdef USE_QT
-        // 判断日志级别，选择颜色
-        static constexpr const char* RED = "\033[31m";
-        static constexpr const char* GREEN = "\033[32m";
-        static constexpr const char* YELLOW = "\033[33m";
-        static constexpr const char* BLUE = "\033[34m";
-        static constexpr const char* MAGENTA = "\033[35m";
-        static constexpr const char* CYAN = "\033[36m";
-        static constexpr const char* WHITE = "\033[37m";
-        static constexpr const char* RESET = "\033[0m";
-        const char* colorCode;
-        switch (event->level) {
-        case Level::Debug: colorCode = BLUE; break;
-        case Level::Info: colorCode = GREEN; break;
-        case Level::Warning: colorCode = YELLOW; break;
-        case Level::Error: colorCode = RED; break;
-        case Level::Fatal: colorCode = MAGENTA; break;
-        default: // Level::Unknown 或其他未知级别
-            colorCode = WHITE;
-            break;
+        if (_installed.exchange(true)) {
+            return true;
         }
-        // 打印彩色日志
-        qDebug() << colorCode << formatter->format(event).c_str() << RESET;
-#else
-        std::cout << formatter->format(event) << std::endl;
-        std::cout.flush();
+        _registry = &AppenderRegistry::instance();
+#if QLOG_HAS_BACKTRACE
+        // 第一次调用backtrace会加载libgcc, 不能放到信号处理函数里
+        void* frames[1];
+        ::backtrace(frames, 1);
 #endif
+        // 栈溢出时原来的栈已经不能用了, 安装线程上用单独的栈
+        static char alternateStack[64 * 1024];
+        stack_t stack{};
+        stack.ss_sp = alternateStack;
+        stack.ss_size = sizeof(alternateStack);
+        ::sigaltstack(&stack, nullptr);
+
+        struct sigaction action{};
+        action.sa_sigaction = &CrashHandler::handle;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        for (size_t i = 0; i < std::size(SIGNALS); ++i) {
+            ::sigaction(SIGNALS[i], &action, &_previous[i]);
+        }
         return true;
+    }
 
-        // file
+    inline void CrashHandler::uninstall()
+    {
+        if (!_installed.exchange(false)) {
+            return;
+        }
+        for (size_t i = 0; i < std::size(SIGNALS); ++i) {
+            ::sigaction(SIGNALS[i], &_previous[i], nullptr);
+        }
     }
 
-    inline FileAppender::FileAppender()
+    inline void CrashHandler::handle(int signal, siginfo_t* info, void* /*context*/)
     {
-#ifdef USE_QT
-        _basePath = QApplication::applicationDirPath().toStdString() + "/";
+        if (!_handling.exchange(true)) {
+            void* frames[MAX_FRAMES];
+            int depth = 0;
+#if QLOG_HAS_BACKTRACE
+            depth = ::backtrace(frames, MAX_FRAMES);
 #endif
-        _basePath += "log";
-        setLevel(Level::Info);
+            char message[256];
+            const size_t length = formatMessage(message, sizeof(message), signal, info ? info->si_addr : nullptr);
+            if (_registry) {
+                _registry->crash(std::string_view(message, length), frames, depth);
+            }
+        }
+        // 恢复原来的处理方式后重新发出信号, 处理函数返回后就会按原来的方式处理
+        for (size_t i = 0; i < std::size(SIGNALS); ++i) {
+            if (SIGNALS[i] == signal) {
+                ::sigaction(signal, &_previous[i], nullptr);
+            }
+        }
+        ::raise(signal);
     }
 
-    inline FileAppender::~FileAppender()
+    inline size_t CrashHandler::formatMessage(char* out, size_t capacity, int signal, const void* address)
     {
-        if (_file.is_open()) {
-            _file.flush();
-            _file.close();
+        size_t length = 0;
+        auto append = [&](std::string_view text) {
+            const size_t n = std::min(text.size(), capacity - length);
+            std::memcpy(out + length, text.data(), n);
+            length += n;
+        };
+        auto appendNumber = [&](auto value, int width = 0, int base = 10) {
+            char digits[24];
+            const auto end = std::to_chars(digits, digits + sizeof(digits), value, base).ptr;
+            for (auto n = end - digits; n < width; ++n) {
+                append("0");
+            }
+            append(std::string_view(digits, static_cast<size_t>(end - digits)));
+        };
+        // gmtime不是异步信号安全的, 自己把天数换算成年月日
+        timespec ts{};
+        ::clock_gettime(CLOCK_REALTIME, &ts);
+        const int64_t days = ts.tv_sec / 86400;
+        const int64_t daySecond = ts.tv_sec % 86400;
+        const int64_t z = days + 719468;
+        const int64_t era = z / 146097;
+        const int64_t doe = z - era * 146097;
+        const int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        const int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        const int64_t mp = (5 * doy + 2) / 153;
+        const int64_t day = doy - (153 * mp + 2) / 5 + 1;
+        const int64_t month = mp < 10 ? mp + 3 : mp - 9;
+        const int64_t year = yoe + era * 400 + (month <= 2 ? 1 : 0);
+
+        append("[FATAL][");
+        appendNumber(year);
+        append("-");
+        appendNumber(month, 2);
+        append("-");
+        appendNumber(day, 2);
+        append(" ");
+        appendNumber(daySecond / 3600, 2);
+        append(":");
+        appendNumber(daySecond / 60 % 60, 2);
+        append(":");
+        appendNumber(daySecond % 60, 2);
+        append(".");
+        appendNumber(ts.tv_nsec / 1000000, 3);
+        append("][");
+        appendNumber(currentThreadId());
+        append("][qlog] caught signal ");
+        appendNumber(signal);
+        switch (signal) {
+        case SIGSEGV: append(" (SIGSEGV)"); break;
+        case SIGABRT: append(" (SIGABRT)"); break;
+        case SIGBUS: append(" (SIGBUS)"); break;
+        case SIGFPE: append(" (SIGFPE)"); break;
+        case SIGILL: append(" (SIGILL)"); break;
+        default: break;
         }
+        if (signal != SIGABRT) {
+            append(" at address 0x");
+            appendNumber(reinterpret_cast<uintptr_t>(address), 0, 16);
+        }
+        append(", backtrace:\n");
+        return length;
     }
+#endif
 
-    inline void FileAppender::setBasePath(const std::string& basePath)
+    // =============================          metrics
+    inline size_t LatencyHistogram::bucket(uint64_t ns)
     {
-        _basePath = basePath;
-        // std::filesystem::create_directories(_basePath);
+        if (ns < 8) {
+            return static_cast<size_t>(ns);
+        }
+        // 最高位决定段, 接下来的3位决定段内的桶
+        const int exponent = std::bit_width(ns) - 1;
+        return static_cast<size_t>(exponent - 2) * 8 + static_cast<size_t>((ns >> (exponent - 3)) & 7);
     }
 
-    inline void FileAppender::setPath(const std::string& path)
+    inline uint64_t LatencyHistogram::upperBound(size_t index)
     {
-        _path = path;
+        if (index < 8) {
+            return index;
+        }
+        const int exponent = static_cast<int>(index / 8) + 2;
+        const uint64_t sub = index % 8;
+        if (exponent == 63 && sub == 7) {
+            return UINT64_MAX;
+        }
+        return ((9 + sub) << (exponent - 3)) - 1;
     }
 
-    inline void FileAppender::setFileSplitPolicy(const FileSplitPolicy& cb)
+    inline void LatencyHistogram::record(uint64_t ns)
     {
-        _fileSplitPolicy = cb;
+        _buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(ns, std::memory_order_relaxed);
+        // 大多数时候不是最大值, 只读一次
+        uint64_t max = _max.load(std::memory_order_relaxed);
+        while (ns > max && !_max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+        }
     }
 
-    inline const size_t FileAppender::filesize()
+    inline LatencyHistogram::Summary LatencyHistogram::summary() const
     {
-        // byte
-        return _file.tellp();
+        Summary summary;
+        uint64_t counts[BUCKETS];
+        uint64_t total = 0;
+        // 和写入并发时各个计数不是同一时刻的, 以桶里的数量为准
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            counts[i] = _buckets[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+        if (total == 0) {
+            return summary;
+        }
+        summary.count = total;
+        summary.max = _max.load(std::memory_order_relaxed);
+        summary.mean = _sum.load(std::memory_order_relaxed) / std::max<uint64_t>(_count.load(std::memory_order_relaxed), 1);
+        auto percentile = [&](uint64_t perMille) {
+            const uint64_t rank = std::max<uint64_t>((total * perMille + 999) / 1000, 1);
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    return std::min(upperBound(i), summary.max);
+                }
+            }
+            return summary.max;
+        };
+        summary.p50 = percentile(500);
+        summary.p90 = percentile(900);
+        summary.p99 = percentile(990);
+        summary.p999 = percentile(999);
+        return summary;
     }
 
-    inline std::string FileAppender::filename() const
+    inline Metrics& Metrics::instance()
     {
-        return _filename;
+        static std::once_flag _flag;
+        static std::unique_ptr<Metrics> _self;
+        std::call_once(_flag,
+            [&] {
+            _self.reset(new Metrics);
+        });
+        return *_self;
+    }
+
+    inline uint64_t Metrics::now()
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    inline Metrics::Snapshot Metrics::snapshot()
+    {
+        Snapshot snapshot;
+        snapshot.events = _events.load(std::memory_order_relaxed);
+        snapshot.filtered = _filtered.load(std::memory_order_relaxed);
+        snapshot.dropped = AsyncWorker::instance().droppedCount();
+        snapshot.pendingBytes = AsyncWorker::instance().pendingBytes();
+        for (const auto& [name, appender] : AppenderRegistry::instance().appenders()) {
+            if (!appender) {
+                continue;
+            }
+            const auto& metrics = appender->metrics();
+            auto& stats = snapshot.appenders[name];
+            stats.events = metrics.events.load(std::memory_order_relaxed);
+            stats.filtered = metrics.filtered.load(std::memory_order_relaxed);
+            stats.dropped = metrics.dropped.load(std::memory_order_relaxed);
+            stats.bytes = metrics.bytes.load(std::memory_order_relaxed);
+            stats.rotations = metrics.rotations.load(std::memory_order_relaxed);
+            stats.format = metrics.formatTime.summary();
+            stats.flush = metrics.flushTime.summary();
+            stats.lockWait = metrics.lockWait.summary();
+        }
+        return snapshot;
+    }
+
+    inline std::string Metrics::Snapshot::toString() const
+    {
+        std::string out = std::format("events={} filtered={} dropped={} pending_bytes={}", events, filtered, dropped, pendingBytes);
+        for (const auto& [name, stats] : appenders) {
+            out += std::format(" | {}: events={} filtered={} dropped={} bytes={} rotations={} format_ns={}/{}/{} flush_ns={}/{}/{} lock_waits={} lock_wait_ns={}/{}/{}",
+                name, stats.events, stats.filtered, stats.dropped, stats.bytes, stats.rotations,
+                stats.format.p50, stats.format.p99, stats.format.max,
+                stats.flush.p50, stats.flush.p99, stats.flush.max,
+                stats.lockWait.count, stats.lockWait.p50, stats.lockWait.p99, stats.lockWait.max);
+        }
+        return out;
+    }
+
+    // =============================          LogSite
+    inline bool LogSite::everyN(uint64_t n)
+    {
+        const uint64_t count = _count.fetch_add(1, std::memory_order_relaxed);
+        if (n <= 1) {
+            return true;
+        }
+        if (count % n != 0) {
+            return false;
+        }
+        // 被跳过的次数是确定的, 不需要在丢弃时计数
+        if (count != 0) {
+            suppress(n - 1);
+        }
+        return true;
+    }
+
+    inline bool LogSite::firstN(uint64_t n)
+    {
+        // 超过之后_count不再增加, 只计丢弃数量
+        if (_count.load(std::memory_order_relaxed) >= n || _count.fetch_add(1, std::memory_order_relaxed) >= n) {
+            suppress(1);
+            return false;
+        }
+        return true;
+    }
+
+    inline bool LogSite::rateLimit(uint32_t perSecond)
+    {
+        if (perSecond == 0) {
+            return false;
+        }
+        const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        const int64_t interval = 1000000000 / perSecond;
+        // 桶满时可以连续写perSecond条
+        const int64_t burst = interval * (perSecond - 1);
+        int64_t tat = _tat.load(std::memory_order_relaxed);
+        int64_t next;
+        do {
+            const int64_t base = std::max(tat, now);
+            if (base - now > burst) {
+                suppress(1);
+                return false;
+            }
+            next = base + interval;
+        } while (!_tat.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+        return true;
+    }
+
+    inline Logger& LogSite::annotate(Logger&& logger)
+    {
+        if (_suppressed.load(std::memory_order_relaxed) != 0) {
+            if (const uint64_t suppressed = takeSuppressed()) {
+                logger.with("suppressed", suppressed);
+                _emitted.store(true, std::memory_order_relaxed);
+            }
+        }
+        return logger;
+    }
+
+    inline void LogSite::suppress(uint64_t n)
+    {
+        if (_suppressed.fetch_add(n, std::memory_order_relaxed) != 0) {
+            return;
+        }
+        _pending.fetch_add(1, std::memory_order_relaxed);
+        if (!_listed.load(std::memory_order_relaxed) && !_listed.exchange(true, std::memory_order_relaxed)) {
+            LogSite* head = _sites.load(std::memory_order_relaxed);
+            do {
+                _next = head;
+            } while (!_sites.compare_exchange_weak(head, this, std::memory_order_release, std::memory_order_relaxed));
+        }
+    }
+
+    inline uint64_t LogSite::takeSuppressed()
+    {
+        const uint64_t suppressed = _suppressed.exchange(0, std::memory_order_relaxed);
+        if (suppressed != 0) {
+            _pending.fetch_sub(1, std::memory_order_relaxed);
+        }
+        return suppressed;
+    }
+
+    inline void LogSite::reportSuppressed(bool final)
+    {
+        using namespace std::chrono;
+        if (!final) {
+            // 同步模式下可能有多个线程同时调用, 只让一个写
+            const int64_t now = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+            int64_t last = _lastReport.load(std::memory_order_relaxed);
+            if (now - last < duration_cast<nanoseconds>(seconds(1)).count() || !_lastReport.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+                return;
+            }
+        }
+        for (LogSite* site = _sites.load(std::memory_order_acquire); site; site = site->_next) {
+            // 还在限流中写日志的位置, 数量会跟着下一条写出
+            if (site->_emitted.exchange(false, std::memory_order_relaxed) && !final) {
+                continue;
+            }
+            if (site->_suppressed.load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+            const uint64_t suppressed = site->takeSuppressed();
+            if (suppressed == 0) {
+                continue;
+            }
+            auto event = Event::create();
+            event->timeNs = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+            event->time = event->timeNs / 1000000;
+            event->level = site->_level;
+            event->file = site->_file;
+            event->line = site->_line;
+            event->threadId = currentThreadId();
+            event->threadName = currentThreadName();
+            event->content << "[qlog] suppressed " << suppressed << " messages";
+            // 直接写, 不经过队列
+            AppenderRegistry::instance().dispatch(event);
+        }
+    }
+
+    // =============================          async
+    template <typename T>
+    MpscQueue<T>::MpscQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        _mask = size - 1;
+        _cells.reset(new Cell[size]);
+        for (size_t i = 0; i < size; ++i) {
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    template <typename T>
+    bool MpscQueue<T>::tryPush(T&& value)
+    {
+        size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = _cells[pos & _mask];
+            const size_t seq = cell.sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                // 抢到了这个位置
+                if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = std::move(value);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                // 队列满了
+                return false;
+            }
+            else {
+                pos = _enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    template <typename T>
+    bool MpscQueue<T>::tryPop(T& value)
+    {
+        Cell& cell = _cells[_dequeuePos & _mask];
+        const size_t seq = cell.sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(_dequeuePos + 1) < 0) {
+            return false;
+        }
+        value = std::move(cell.data);
+        cell.data = T();
+        cell.sequence.store(_dequeuePos + _mask + 1, std::memory_order_release);
+        ++_dequeuePos;
+        return true;
+    }
+
+    inline AsyncWorker::AsyncWorker() { }
+
+    inline AsyncWorker::~AsyncWorker()
+    {
+        stop();
+    }
+
+    inline AsyncWorker& AsyncWorker::instance()
+    {
+        // 保证registry和metrics先于_self构造，退出时后于worker析构，这样析构时还能把剩余日志写完。
+        AppenderRegistry::instance();
+        Metrics::instance();
+        static std::once_flag _flag;
+        static std::unique_ptr<AsyncWorker> _self;
+        std::call_once(_flag,
+            [&] {
+            _self.reset(new AsyncWorker);
+        });
+        return *_self;
+    }
+
+    inline void AsyncWorker::start(size_t capacity)
+    {
+        std::lock_guard lock(_mtxControl);
+        if (running()) {
+            return;
+        }
+        _queue = std::make_unique<MpscQueue<Event::Ptr>>(capacity);
+        _running.store(true, std::memory_order_release);
+        _thread = std::thread(&AsyncWorker::run, this);
+    }
+
+    inline void AsyncWorker::stop()
+    {
+        std::lock_guard lock(_mtxControl);
+        if (!running()) {
+            return;
+        }
+        _running.store(false, std::memory_order_release);
+        _cvWake.notify_one();
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        // 已经进入push的生产者可能在后台线程最后一次drain之后才入队, 等它们离开后在这里写完;
+        // 阻塞等待位置的生产者也靠这里腾出位置
+        while (_producers.fetch_add(0, std::memory_order_acq_rel) != 0) {
+            drain();
+            std::this_thread::yield();
+        }
+        drain();
+        LogSite::reportSuppressed(true);
+        AppenderRegistry::instance().idle(true);
+    }
+
+    inline bool AsyncWorker::push(Event::Ptr event)
+    {
+        // 同步模式下不碰共享的计数
+        if (!_running.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        // stop()用读改写读取计数, 在它之后才计数的生产者一定能看到_running为false
+        _producers.fetch_add(1, std::memory_order_acquire);
+        if (!_running.load(std::memory_order_acquire)) {
+            _producers.fetch_sub(1, std::memory_order_release);
+            return false;
+        }
+        const size_t bytes = event->memoryUsage();
+        const size_t budget = _memoryBudget.load(std::memory_order_relaxed);
+        // 积压时才查appender的处理方式
+        std::optional<OverflowPolicy> policy;
+        bool resolved = false;
+        bool queued = false;
+        while (true) {
+            // 单条超出预算的日志在队列空时仍然可以入队
+            const size_t pending = _pendingBytes.load(std::memory_order_relaxed);
+            if (budget == 0 || pending == 0 || pending + bytes <= budget) {
+                // 先计入, 后台线程出队后才减去
+                _pendingBytes.fetch_add(bytes, std::memory_order_relaxed);
+                if (_queue->tryPush(std::move(event))) {
+                    queued = true;
+                    break;
+                }
+                _pendingBytes.fetch_sub(bytes, std::memory_order_relaxed);
+            }
+            if (!resolved) {
+                policy = AppenderRegistry::instance().overflowPolicy(event);
+                resolved = true;
+            }
+            if (!policy) {
+                // 没有appender会写也不会被backtrace保存, 直接丢掉也不算丢弃
+                queued = true;
+                break;
+            }
+            if (*policy == OverflowPolicy::Synchronous) {
+                break;
+            }
+            if (*policy == OverflowPolicy::DropOldest) {
+                _shedding.store(true, std::memory_order_relaxed);
+            }
+            if (*policy == OverflowPolicy::DropNewest || (*policy == OverflowPolicy::DropOldest && event->level < Level::Error)) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                queued = true;
+                break;
+            }
+            // 等后台线程腾出位置
+            _cvWake.notify_one();
+            std::this_thread::yield();
+        }
+        _producers.fetch_sub(1, std::memory_order_release);
+        if (_sleeping.load(std::memory_order_acquire)) {
+            _cvWake.notify_one();
+        }
+        return queued;
+    }
+
+    inline size_t AsyncWorker::drain()
+    {
+        size_t count = 0;
+        Event::Ptr event;
+        while (_queue->tryPop(event)) {
+            // 要在分发前减去, 延迟格式化会改变内容的大小
+            _pendingBytes.fetch_sub(event->memoryUsage(), std::memory_order_relaxed);
+            bool drop = false;
+            if (_shedding.load(std::memory_order_relaxed)) {
+                const size_t budget = _memoryBudget.load(std::memory_order_relaxed);
+                if (_queue->size() <= _queue->capacity() / 2 && (budget == 0 || _pendingBytes.load(std::memory_order_relaxed) <= budget / 2)) {
+                    _shedding.store(false, std::memory_order_relaxed);
+                }
+                else if (event->level < Level::Error && AppenderRegistry::instance().overflowPolicy(event) == OverflowPolicy::DropOldest) {
+                    drop = true;
+                }
+            }
+            if (drop) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            else {
+                AppenderRegistry::instance().dispatch(event);
+            }
+            event.reset();
+            // 一直有日志时也要定期报告
+            if ((++count & 1023) == 0) {
+                reportDropped();
+                reportMetrics();
+            }
+        }
+        return count;
+    }
+
+    inline void AsyncWorker::reportDropped()
+    {
+        using namespace std::chrono;
+        const uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+        const auto now = steady_clock::now();
+        if (dropped == _reported || now - _lastReport < seconds(1)) {
+            return;
+        }
+        emit(Level::Warning, std::format("[qlog] dropped {} events because the async queue was full (total {})", dropped - _reported, dropped));
+        _reported = dropped;
+        _lastReport = now;
+    }
+
+    inline void AsyncWorker::reportMetrics()
+    {
+        const auto interval = Metrics::instance().reportInterval();
+        const auto now = std::chrono::steady_clock::now();
+        if (interval.count() <= 0 || now - _lastMetricsReport < interval) {
+            return;
+        }
+        _lastMetricsReport = now;
+        emit(Level::Info, "[qlog] " + Metrics::instance().snapshot().toString());
+    }
+
+    inline void AsyncWorker::emit(Level level, std::string_view message)
+    {
+        using namespace std::chrono;
+        auto event = Event::create();
+        event->timeNs = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+        event->time = event->timeNs / 1000000;
+        event->level = level;
+        event->file = "qlog";
+        event->threadId = currentThreadId();
+        event->threadName = currentThreadName();
+        event->content.append(message);
+        // 直接写, 不能再放回可能已满的队列
+        AppenderRegistry::instance().dispatch(event);
+    }
+
+    inline void AsyncWorker::run()
+    {
+        setThreadName("qlog-async");
+        while (running()) {
+            if (drain() > 0) {
+                continue;
+            }
+            reportDropped();
+            reportMetrics();
+            LogSite::reportSuppressed();
+            AppenderRegistry::instance().idle();
+            // 队列空了，休眠等待生产者唤醒; 超时是为了防止丢失唤醒
+            std::unique_lock lock(_mtxWake);
+            _sleeping.store(true, std::memory_order_release);
+            if (running() && drain() == 0) {
+                _cvWake.wait_for(lock, std::chrono::milliseconds(50));
+            }
+            _sleeping.store(false, std::memory_order_release);
+        }
+        // 退出前写完剩余的日志
+        drain();
+        // 退出前报告剩余的丢弃数量
+        _lastReport = {};
+        reportDropped();
+        LogSite::reportSuppressed(true);
+        AppenderRegistry::instance().idle(true);
+    }
+
+    // =============================          appenders
+    inline void Appender::setLevel(Level level)
+    {
+        _level = level;
+        AppenderRegistry::instance().updateMinLevel();
+    }
+
+    inline bool Appender::write(Event::Ptr event)
+    {
+        _metrics.events.fetch_add(1, std::memory_order_relaxed);
+        const bool timing = Metrics::timing();
+        std::unique_lock lock(_mtxFlush, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            // 只有抢不到锁时才计时
+            const uint64_t start = timing ? Metrics::now() : 0;
+            lock.lock();
+            if (timing) {
+                _metrics.lockWait.record(Metrics::now() - start);
+            }
+        }
+        if (_collapse && collapse(event)) {
+            return true;
+        }
+        const uint64_t start = timing ? Metrics::now() : 0;
+        const bool ok = flush(event);
+        if (timing) {
+            _metrics.flushTime.record(Metrics::now() - start);
+        }
+        if (!ok) {
+            _metrics.dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        return ok;
+    }
+
+    inline void Appender::idle(bool final)
+    {
+        std::lock_guard lock(_mtxFlush);
+        // 退出前不管是否超时都要写出来, 之后可能再也没有机会
+        if (_repeats > 0 && (final || std::chrono::steady_clock::now() - _firstRepeat >= _collapseTimeout)) {
+            flushRepeats();
+        }
+        onIdle();
+    }
+
+    inline void Appender::finishRepeats()
+    {
+        std::lock_guard lock(_mtxFlush);
+        flushRepeats();
+    }
+
+    inline void Appender::expireRepeats()
+    {
+        // 调用dispatch的线程可能正拿着这个锁(例如在flush里写日志), 拿不到就下次再检查
+        std::unique_lock lock(_mtxFlush, std::try_to_lock);
+        if (lock.owns_lock() && _repeats > 0 && std::chrono::steady_clock::now() - _firstRepeat >= _collapseTimeout) {
+            flushRepeats();
+        }
+    }
+
+    inline void Appender::setCollapseDuplicates(bool enable, std::chrono::milliseconds timeout)
+    {
+        std::lock_guard lock(_mtxFlush);
+        if (!enable) {
+            flushRepeats();
+            _lastEvent.reset();
+        }
+        _collapse = enable;
+        _collapseTimeout = timeout;
+    }
+
+    inline bool Appender::collapse(const Event::Ptr& event)
+    {
+        // 只比较哈希, 比格式化和写文件便宜得多
+        size_t hash = std::hash<std::string_view>()(event->content.view());
+        hash ^= (std::hash<std::string_view>()(event->file) + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2));
+        hash ^= (static_cast<size_t>(event->line) << 8 | static_cast<size_t>(event->level)) * 0x9e3779b97f4a7c15ull;
+        if (_lastEvent && hash == _lastHash) {
+            if (_repeats++ == 0) {
+                _firstRepeat = std::chrono::steady_clock::now();
+                AppenderRegistry::_pendingRepeats.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (std::chrono::steady_clock::now() - _firstRepeat >= _collapseTimeout) {
+                flushRepeats();
+            }
+            return true;
+        }
+        flushRepeats();
+        _lastHash = hash;
+        _lastEvent = event;
+        return false;
+    }
+
+    inline void Appender::flushRepeats()
+    {
+        if (_repeats == 0 || !_lastEvent) {
+            return;
+        }
+        using namespace std::chrono;
+        auto summary = Event::create();
+        summary->timeNs = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+        summary->time = summary->timeNs / 1000000;
+        summary->level = _lastEvent->level;
+        summary->code = _lastEvent->code;
+        summary->line = _lastEvent->line;
+        summary->file = _lastEvent->file;
+        summary->threadId = _lastEvent->threadId;
+        summary->threadName = _lastEvent->threadName;
+        summary->key = _lastEvent->key;
+        summary->formatter = _lastEvent->formatter;
+        summary->content << "last message repeated " << _repeats << " times";
+        _repeats = 0;
+        AppenderRegistry::_pendingRepeats.fetch_sub(1, std::memory_order_relaxed);
+        flush(summary);
+    }
+
+    inline Formatter::Ptr Appender::getFormatter(Event::Ptr event)
+    {
+        if (!event->formatter && !_formatter) {
+            _formatter = std::make_shared<Formatter>();
+        }
+        return (event->formatter ? event->formatter : _formatter);
+    }
+
+    inline void Appender::formatTo(const Event::Ptr& event, std::string& out)
+    {
+        const auto formatter = getFormatter(event);
+        if (!Metrics::timing()) {
+            formatter->formatTo(event, out);
+            return;
+        }
+        const uint64_t start = Metrics::now();
+        formatter->formatTo(event, out);
+        _metrics.formatTime.record(Metrics::now() - start);
+    }
+
+    inline const std::string& Appender::render(const Event::Ptr& event)
+    {
+        _line.clear();
+        formatTo(event, _line);
+        return _line;
+    }
+
+#ifdef USE_QT
+    inline ConsoleAppender::ConsoleAppender()
+    {
+        _level = Level::Debug;
+    }
+
+    inline ConsoleAppender::~ConsoleAppender()
+    {
+        finishRepeats();
+    }
+
+    inline void ConsoleAppender::setColor(bool) { }
+
+    inline void ConsoleAppender::setDropDebugOnPressure(bool) { }
+
+    inline void ConsoleAppender::onCrash(std::string_view, void* const*, int) { }
+
+    inline void ConsoleAppender::onIdle() { }
+
+    inline void ConsoleAppender::writeBatch(bool) { }
+
+    inline bool ConsoleAppender::flush(Event::Ptr event)
+    {
+        // 判断日志级别，选择颜色
+        static constexpr const char* RED = "\033[31m";
+        static constexpr const char* GREEN = "\033[32m";
+        static constexpr const char* YELLOW = "\033[33m";
+        static constexpr const char* BLUE = "\033[34m";
+        static constexpr const char* MAGENTA = "\033[35m";
+        static constexpr const char* CYAN = "\033[36m";
+        static constexpr const char* WHITE = "\033[37m";
+        static constexpr const char* RESET = "\033[0m";
+        const char* colorCode;
+        switch (event->level) {
+        case Level::Debug: colorCode = BLUE; break;
+        case Level::Info: colorCode = GREEN; break;
+        case Level::Warning: colorCode = YELLOW; break;
+        case Level::Error: colorCode = RED; break;
+        case Level::Fatal: colorCode = MAGENTA; break;
+        default: // Level::Unknown 或其他未知级别
+            colorCode = WHITE;
+            break;
+        }
+        // 打印彩色日志
+        qDebug() << colorCode << render(event).c_str() << RESET;
+        return true;
+    }
+#else
+    inline ConsoleAppender::ConsoleAppender()
+    {
+        _level = Level::Debug;
+#ifdef QLOG_WINDOWS
+        const int fd = _fileno(stdout);
+        _color = ::_isatty(fd) != 0;
+        if (_color) {
+            // 让Windows控制台解析ANSI颜色
+            HANDLE handle = ::GetStdHandle(STD_OUTPUT_HANDLE);
+            DWORD mode = 0;
+            _color = ::GetConsoleMode(handle, &mode) && ::SetConsoleMode(handle, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+        }
+#else
+        _color = ::isatty(STDOUT_FILENO) != 0;
+#endif
+        if (std::getenv("NO_COLOR")) {
+            _color = false;
+        }
+    }
+
+    inline ConsoleAppender::~ConsoleAppender()
+    {
+        finishRepeats();
+        writeBatch(true);
+    }
+
+    inline void ConsoleAppender::setColor(bool enable)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _color = enable;
+    }
+
+    inline void ConsoleAppender::setDropDebugOnPressure(bool enable)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _dropDebug = enable;
+    }
+
+    inline void ConsoleAppender::onIdle()
+    {
+        writeBatch(false);
+    }
+
+    inline void ConsoleAppender::onCrash(std::string_view message, [[maybe_unused]] void* const* frames, [[maybe_unused]] int depth)
+    {
+#ifdef QLOG_WINDOWS
+        const int fd = _fileno(stdout);
+#else
+        const int fd = STDOUT_FILENO;
+#endif
+        CrashHandler::writeAll(fd, _batch.data(), _batch.size());
+        CrashHandler::writeAll(fd, message.data(), message.size());
+#if QLOG_HAS_BACKTRACE
+        ::backtrace_symbols_fd(frames, depth, fd);
+#endif
+    }
+
+    inline bool ConsoleAppender::flush(Event::Ptr event)
+    {
+        if (_dropDebug && _pressure && event->level == Level::Debug) {
+            ++_dropped;
+            _metrics.dropped.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        if (_color) {
+            static constexpr std::string_view COLORS[] = {
+                "\033[37m", // Unknown
+                "\033[34m", // Debug
+                "\033[32m", // Info
+                "\033[33m", // Warning
+                "\033[31m", // Error
+                "\033[35m", // Fatal
+            };
+            const auto index = static_cast<size_t>(event->level);
+            _batch += index < std::size(COLORS) ? COLORS[index] : COLORS[0];
+            formatTo(event, _batch);
+            _batch += "\033[0m\n";
+        }
+        else {
+            formatTo(event, _batch);
+            _batch += '\n';
+        }
+        // 同步模式下每条都直接写; Error及以上不能等
+        if (!AsyncWorker::instance().running() || event->level >= Level::Error || _batch.size() >= BATCH_SIZE) {
+            writeBatch(!_dropDebug || event->level > Level::Debug || _batch.size() >= BATCH_SIZE);
+        }
+        return true;
+    }
+
+    inline void ConsoleAppender::writeBatch(bool force)
+    {
+#ifdef QLOG_WINDOWS
+        const int fd = _fileno(stdout);
+#else
+        const int fd = STDOUT_FILENO;
+        if (_dropDebug) {
+            // 先看一下能不能写, 写不进去就标记为有压力, 之后的Debug日志直接丢弃
+            pollfd pfd{fd, POLLOUT, 0};
+            _pressure = ::poll(&pfd, 1, 0) == 0;
+            if (_pressure && !force) {
+                return;
+            }
+        }
+#endif
+        if (_dropped > 0 && !_pressure) {
+            _batch += std::format("[qlog] dropped {} debug messages\n", _dropped);
+            _dropped = 0;
+        }
+        // 一批日志只需要一次系统调用
+        const char* data = _batch.data();
+        size_t size = _batch.size();
+        while (size > 0) {
+#ifdef QLOG_WINDOWS
+            const auto n = ::_write(fd, data, static_cast<unsigned int>(size));
+#else
+            const auto n = ::write(fd, data, size);
+            if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (errno != EINTR) {
+                    // 被设置成了非阻塞, 等到能写为止
+                    pollfd pfd{fd, POLLOUT, 0};
+                    ::poll(&pfd, 1, -1);
+                }
+                continue;
+            }
+#endif
+            if (n <= 0) {
+                break;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+            _metrics.bytes.fetch_add(static_cast<uint64_t>(n), std::memory_order_relaxed);
+        }
+        _batch.clear();
+    }
+#endif
+
+    inline FileAppender::FileAppender()
+    {
+#ifdef USE_QT
+        _basePath = QApplication::applicationDirPath().toStdString() + "/";
+#endif
+        _basePath += "log";
+        setLevel(Level::Info);
+    }
+
+    inline FileAppender::~FileAppender()
+    {
+        finishRepeats();
+        if (_file.isOpen()) {
+            writeBuffer(_syncPolicy != SyncPolicy::Never);
+            _file.close();
+        }
+        if (_prepared.valid()) {
+            PreparedFile prepared = _prepared.get();
+            discardFile(prepared);
+        }
+    }
+
+    inline void FileAppender::setMaxFileSize(size_t size)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _maxFileSize = size;
+    }
+
+    inline void FileAppender::setBufferSize(size_t size)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _bufferSize = size;
+        if (_buffer.size() >= _bufferSize) {
+            writeBuffer(false);
+        }
+        _buffer.reserve(_bufferSize);
+    }
+
+    inline void FileAppender::setFlushInterval(std::chrono::milliseconds interval)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _flushInterval = interval;
+    }
+
+    inline void FileAppender::setSyncPolicy(SyncPolicy policy)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _syncPolicy = policy;
+    }
+
+    inline void FileAppender::flushBuffer()
+    {
+        std::lock_guard lock(_mtxFlush);
+        writeBuffer(_syncPolicy == SyncPolicy::Interval);
+    }
+
+    inline void FileAppender::onIdle()
+    {
+        if (!_buffer.empty() && std::chrono::steady_clock::now() - _lastFlush >= _flushInterval) {
+            writeBuffer(_syncPolicy == SyncPolicy::Interval);
+        }
+    }
+
+    inline bool FileAppender::writeBuffer(bool sync)
+    {
+        _lastFlush = std::chrono::steady_clock::now();
+        if (_buffer.empty()) {
+            return true;
+        }
+        const bool ok = _file.write(_buffer.data(), _buffer.size());
+        if (ok) {
+            _metrics.bytes.fetch_add(_buffer.size(), std::memory_order_relaxed);
+        }
+        _buffer.clear();
+        if (ok && sync) {
+            _file.sync();
+        }
+        return ok;
+    }
+
+    inline void FileAppender::writeBufferOnCrash()
+    {
+        // 崩溃的线程可能正在修改缓冲区, 只能尽力而为
+        if (_file.isOpen()) {
+            CrashHandler::writeAll(_file.fd(), _buffer.data(), _buffer.size());
+        }
+    }
+
+    inline void FileAppender::onCrash(std::string_view message, [[maybe_unused]] void* const* frames, [[maybe_unused]] int depth)
+    {
+        writeBufferOnCrash();
+        if (!_file.isOpen()) {
+            return;
+        }
+        CrashHandler::writeAll(_file.fd(), message.data(), message.size());
+#if QLOG_HAS_BACKTRACE
+        ::backtrace_symbols_fd(frames, depth, _file.fd());
+#endif
+    }
+
+    inline void BinaryFileAppender::onCrash(std::string_view, void* const*, int)
+    {
+        writeBufferOnCrash();
+    }
+
+    inline void FileAppender::setCompression(bool enable)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _compression = enable;
+    }
+
+    inline void FileAppender::setRetention(size_t maxFiles, uint64_t maxBytes)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _retention = {maxFiles, maxBytes};
+    }
+
+    inline void FileAppender::setBasePath(const std::string& basePath)
+    {
+        _basePath = basePath;
+        // std::filesystem::create_directories(_basePath);
+    }
+
+    inline void FileAppender::setPath(const std::string& path)
+    {
+        _path = path;
+    }
+
+    inline void FileAppender::setFileSplitPolicy(const FileSplitPolicy& cb)
+    {
+        _fileSplitPolicy = cb;
+    }
+
+    inline const size_t FileAppender::filesize()
+    {
+        // byte, 包含还在缓冲区中的内容
+        return _file.size() + _buffer.size();
+    }
+
+    inline std::string FileAppender::filename() const
+    {
+        return _filename;
+    }
+
+    inline std::string FileAppender::path() const
+    {
+        return _path;
+    }
+
+    inline std::string FileAppender::basePath() const
+    {
+        return _basePath;
+    }
+
+    inline FileAppender::PreparedFile FileAppender::openFile(const std::string& basePath, const std::string& extension, int64_t timeMs, bool bySize)
+    {
+        constexpr int64_t MS_PER_DAY = 24 * 3600 * 1000;
+        PreparedFile prepared;
+        prepared.bySize = bySize;
+        prepared.dayStart = timeMs - ((timeMs % MS_PER_DAY) + MS_PER_DAY) % MS_PER_DAY;
+        std::tm time{};
+        const std::time_t sTime = static_cast<std::time_t>(timeMs / 1000);
+        gmtime_r(&sTime, &time);
+        const int year = time.tm_year + 1900;
+        const int month = time.tm_mon + 1;
+        const int day = time.tm_mday;
+        // 根据年月设置路径
+        prepared.path = std::format("{}/{}/{}/", basePath, year, month);
+        std::error_code ec;
+        std::filesystem::create_directories(prepared.path, ec);
+        if (bySize) {
+            // 同一秒内再次按大小分割时加上序号, 保证是新文件; 已经压缩成.gz的名字也不能再用
+            const auto stem = std::format("{}-{}-{}_{}_{}_{}", year, month, day, time.tm_hour, time.tm_min, time.tm_sec);
+            for (uint32_t sequence = 0;; ++sequence) {
+                prepared.filename = sequence == 0 ? stem + extension : std::format("{}.{}{}", stem, sequence, extension);
+                const auto filename = prepared.path + prepared.filename;
+                if (!std::filesystem::exists(filename, ec) && !std::filesystem::exists(filename + ".gz", ec)) {
+                    break;
+                }
+            }
+        }
+        else {
+            prepared.filename = std::format("{}-{}-{}{}", year, month, day, extension);
+        }
+        if (prepared.file.open(prepared.path + prepared.filename)) {
+            prepared.created = prepared.file.size() == 0;
+        }
+        return prepared;
+    }
+
+    inline void FileAppender::prepareNextFile(int64_t timeMs, bool bySize)
+    {
+        // 只复制需要的参数, 后台线程不访问this
+        _prepared = std::async(std::launch::async, &FileAppender::openFile, _basePath, _extension, timeMs, bySize);
+    }
+
+    inline void FileAppender::discardFile(PreparedFile& prepared)
+    {
+        if (prepared.file.isOpen()) {
+            const bool empty = prepared.file.size() == 0;
+            prepared.file.close();
+            if (prepared.created && empty) {
+                std::error_code ec;
+                std::filesystem::remove(prepared.path + prepared.filename, ec);
+            }
+        }
+    }
+
+    inline void FileAppender::closeFile(const std::string& fullPath)
+    {
+        if (_file.isOpen()) {
+            writeBuffer(_syncPolicy != SyncPolicy::Never);
+            _file.close();
+            // 内置和自定义的分割策略都从这里换文件
+            _metrics.rotations.fetch_add(1, std::memory_order_relaxed);
+            // 旧文件不会再写了, 交给后台压缩
+            if (_compression && !_filename.empty()) {
+                LogArchiver::instance().submit(fullPath, _basePath, _retention);
+            }
+        }
+    }
+
+    inline bool FileAppender::rotate(int64_t timeMs)
+    {
+        // 同一天内因为大小分割
+        const bool bySize = _file.isOpen() && timeMs >= _dayStart && timeMs < _dayEnd;
+        PreparedFile next;
+        if (_prepared.valid()) {
+            // 一般已经打开好了; 还没完成就等它完成, 也不会比直接打开更慢
+            next = _prepared.get();
+            if (next.bySize != bySize || timeMs < next.dayStart || timeMs - next.dayStart >= 24 * 3600 * 1000) {
+                // 时间跳变等情况, 预先打开的文件不对
+                discardFile(next);
+                next = PreparedFile();
+            }
+        }
+        if (!next.file.isOpen()) {
+            next = openFile(_basePath, _extension, timeMs, bySize);
+            if (!next.file.isOpen()) {
+                return false;
+            }
+        }
+        closeFile(_path + _filename);
+        _file = std::move(next.file);
+        _path = std::move(next.path);
+        _filename = std::move(next.filename);
+        _dayStart = next.dayStart;
+        _dayEnd = next.dayStart + 24 * 3600 * 1000;
+        onFileOpened();
+        return true;
+    }
+
+    inline void FileAppender::suspend()
+    {
+        std::lock_guard lock(_mtxFlush);
+        if (_file.isOpen()) {
+            writeBuffer(_syncPolicy != SyncPolicy::Never);
+            _file.close();
+            _suspended = true;
+        }
+        // 预先打开的文件也占用描述符
+        if (_prepared.valid()) {
+            PreparedFile prepared = _prepared.get();
+            discardFile(prepared);
+        }
+        _buffer.shrink_to_fit();
+    }
+
+    inline bool FileAppender::resetFile(Event::Ptr event)
+    {
+        if (_suspended) {
+            // suspend关闭的文件接着写, 不算新文件
+            _suspended = false;
+            if (!_file.open(_path + _filename)) {
+                return false;
+            }
+        }
+        if (_fileSplitPolicy == nullptr) {
+            // 内置策略: 每条日志只比较时间和大小
+            const size_t size = filesize();
+            if (!_file.isOpen() || event->time < _dayStart || event->time >= _dayEnd || size > _maxFileSize) {
+                return rotate(event->time);
+            }
+            // 快到分割点时在后台打开下一个文件, 分割时直接切换
+            if (!_prepared.valid()) {
+                if (event->time >= _dayEnd - PREPARE_AHEAD) {
+                    prepareNextFile(_dayEnd, false);
+                }
+                else if (size >= _maxFileSize / 10 * 9) {
+                    prepareNextFile(event->time, true);
+                }
+            }
+            return true;
+        }
+        // 自定义策略可能调用setPath, 要在调用前记下当前文件
+        const std::string current = _path + _filename;
+        std::string newFilename = _fileSplitPolicy(event, *this);
+        // 如果路径或文件名发生了变化就重新创建文件
+        if (current != _path + newFilename || !_file.isOpen()) {
+            closeFile(current);
+            //
+            if (!_file.open(_path + newFilename)) {
+                return false;
+            }
+            _filename = newFilename;
+            onFileOpened();
+        }
+        return true;
+    }
+
+    inline bool FileAppender::flush(const Event::Ptr event)
+    {
+        if (!resetFile(event)) {
+            return false;
+        }
+        // 直接编码到缓冲区
+        encode(event, _buffer);
+        if (_bufferSize == 0) {
+            return writeBuffer(_syncPolicy == SyncPolicy::OnError && event->level >= Level::Error);
+        }
+        if (event->level >= Level::Error) {
+            return writeBuffer(_syncPolicy != SyncPolicy::Never);
+        }
+        if (_buffer.size() >= _bufferSize || std::chrono::steady_clock::now() - _lastFlush >= _flushInterval) {
+            return writeBuffer(_syncPolicy == SyncPolicy::Interval);
+        }
+        return true;
+    }
+
+    inline void FileAppender::encode(const Event::Ptr& event, std::string& out)
+    {
+        formatTo(event, out);
+        out.push_back('\n');
+    }
+
+    inline void FileAppender::setExtension(const std::string& extension)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _extension = extension;
+    }
+
+    inline std::string FileAppender::extension() const
+    {
+        return _extension;
+    }
+
+    // ============================= LogFile
+    inline LogFile& LogFile::operator=(LogFile&& other) noexcept
+    {
+        if (this != &other) {
+            close();
+            _fd = std::exchange(other._fd, -1);
+            _size = std::exchange(other._size, 0);
+        }
+        return *this;
+    }
+
+    inline bool LogFile::open(const std::string& filename)
+    {
+        close();
+#ifdef QLOG_WINDOWS
+        _fd = ::_open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_TEXT, _S_IREAD | _S_IWRITE);
+#else
+        _fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+#endif
+        if (_fd < 0) {
+            return false;
+        }
+        struct stat st;
+        _size = ::fstat(_fd, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+        return true;
+    }
+
+    inline void LogFile::close()
+    {
+        if (_fd >= 0) {
+#ifdef QLOG_WINDOWS
+            ::_close(_fd);
+#else
+            ::close(_fd);
+#endif
+            _fd = -1;
+        }
+        _size = 0;
+    }
+
+    inline bool LogFile::write(const char* data, size_t size)
+    {
+        while (size > 0) {
+#ifdef QLOG_WINDOWS
+            const auto n = ::_write(_fd, data, static_cast<unsigned int>(size));
+#else
+            const auto n = ::write(_fd, data, size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+#endif
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+            _size += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    inline void LogFile::sync()
+    {
+        if (_fd < 0) {
+            return;
+        }
+#ifdef QLOG_WINDOWS
+        ::_commit(_fd);
+#elif defined(__APPLE__)
+        ::fsync(_fd);
+#else
+        ::fdatasync(_fd);
+#endif
+    }
+
+    // ============================= LogArchiver
+    inline LogArchiver::~LogArchiver()
+    {
+        {
+            std::lock_guard lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+    }
+
+    inline LogArchiver& LogArchiver::instance()
+    {
+        static std::once_flag flag;
+        static std::unique_ptr<LogArchiver> instance;
+        std::call_once(flag, [&]() { instance.reset(new LogArchiver()); });
+        return *instance;
+    }
+
+    inline void LogArchiver::submit(std::string filename, std::string directory, Retention retention)
+    {
+        {
+            std::lock_guard lock(_mutex);
+            _tasks.push_back({std::move(filename), std::move(directory), retention});
+            if (!_thread.joinable()) {
+                _thread = std::thread(&LogArchiver::run, this);
+            }
+        }
+        _wake.notify_one();
+    }
+
+    inline void LogArchiver::wait()
+    {
+        std::unique_lock lock(_mutex);
+        _idle.wait(lock, [this] { return _tasks.empty() && !_busy; });
+    }
+
+    inline void LogArchiver::run()
+    {
+        setThreadName("qlog-archive");
+        // 压缩不能和业务线程抢CPU
+#ifdef QLOG_WINDOWS
+        ::SetThreadPriority(::GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+        ::setpriority(PRIO_PROCESS, static_cast<id_t>(currentThreadId()), 19);
+#endif
+        std::unique_lock lock(_mutex);
+        while (true) {
+            // 退出前把剩下的任务做完
+            _wake.wait(lock, [this] { return _stop || !_tasks.empty(); });
+            if (_tasks.empty()) {
+                break;
+            }
+            Task task = std::move(_tasks.front());
+            _tasks.pop_front();
+            _busy = true;
+            lock.unlock();
+            if (compress(task.filename, task.filename + ".gz")) {
+                std::error_code ec;
+                std::filesystem::remove(task.filename, ec);
+            }
+            applyRetention(task.directory, task.retention);
+            lock.lock();
+            _busy = false;
+            if (_tasks.empty()) {
+                _idle.notify_all();
+            }
+        }
+    }
+
+    inline void LogArchiver::applyRetention(const std::string& directory, const Retention& retention)
+    {
+        if (retention.maxFiles == 0 && retention.maxBytes == 0) {
+            return;
+        }
+        struct Archive
+        {
+            std::filesystem::path path;
+            std::filesystem::file_time_type time;
+            uint64_t size;
+        };
+        std::vector<Archive> archives;
+        uint64_t total = 0;
+        std::error_code ec;
+        for (auto it = std::filesystem::recursive_directory_iterator(directory, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_regular_file(ec) && it->path().extension() == ".gz") {
+                Archive archive{it->path(), it->last_write_time(ec), it->file_size(ec)};
+                total += archive.size;
+                archives.push_back(std::move(archive));
+            }
+        }
+        // 从最旧的开始删
+        std::sort(archives.begin(), archives.end(), [](const Archive& a, const Archive& b) { return a.time < b.time; });
+        size_t count = archives.size();
+        for (const auto& archive : archives) {
+            const bool tooMany = retention.maxFiles != 0 && count > retention.maxFiles;
+            const bool tooLarge = retention.maxBytes != 0 && total > retention.maxBytes;
+            if (!tooMany && !tooLarge) {
+                break;
+            }
+            if (std::filesystem::remove(archive.path, ec)) {
+                --count;
+                total -= archive.size;
+            }
+        }
+    }
+
+    inline bool LogArchiver::compress(const std::string& source, const std::string& target)
+    {
+        std::ifstream in(source, std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        const std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        in.close();
+        std::string out;
+#if QLOG_USE_ZLIB
+        z_stream stream{};
+        // 31 = 15位窗口 + gzip头
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        out.resize(deflateBound(&stream, static_cast<uLong>(data.size())));
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        stream.avail_in = static_cast<uInt>(data.size());
+        stream.next_out = reinterpret_cast<Bytef*>(out.data());
+        stream.avail_out = static_cast<uInt>(out.size());
+        const int result = ::deflate(&stream, Z_FINISH);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        if (result != Z_STREAM_END) {
+            return false;
+        }
+#else
+        // gzip头: 没有文件名和时间
+        const char header[10] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, '\xff'};
+        out.append(header, sizeof(header));
+        deflate(data.data(), data.size(), out);
+        const uint32_t trailer[2] = {crc32(data.data(), data.size()), static_cast<uint32_t>(data.size())};
+        for (uint32_t value : trailer) {
+            for (int i = 0; i < 4; ++i) {
+                out.push_back(static_cast<char>(value >> (8 * i)));
+            }
+        }
+#endif
+        // 写完再重命名, 不会留下不完整的.gz
+        const std::string temp = target + ".tmp";
+        {
+            std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+            if (!file.write(out.data(), static_cast<std::streamsize>(out.size())) || !file.flush()) {
+                file.close();
+                std::error_code ec;
+                std::filesystem::remove(temp, ec);
+                return false;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(temp, target, ec);
+        return !ec;
+    }
+
+    inline uint32_t LogArchiver::crc32(const char* data, size_t size)
+    {
+        static const auto table = [] {
+            std::array<uint32_t, 256> table{};
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) {
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                table[i] = c;
+            }
+            return table;
+        }();
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    inline void LogArchiver::deflate(const char* data, size_t size, std::string& out)
+    {
+        // RFC 1951, 整个文件是一个使用固定哈夫曼编码的块
+        static constexpr uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static constexpr uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static constexpr uint16_t DIST_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static constexpr uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        constexpr size_t WINDOW = 32768;
+        constexpr size_t MIN_MATCH = 3;
+        constexpr size_t MAX_MATCH = 258;
+        constexpr int HASH_BITS = 15;
+        // 每个位置最多比较的候选数量
+        constexpr int MAX_CHAIN = 16;
+
+        uint64_t bits = 0;
+        int bitCount = 0;
+        auto putBits = [&](uint32_t value, int count) {
+            bits |= static_cast<uint64_t>(value) << bitCount;
+            bitCount += count;
+            while (bitCount >= 8) {
+                out.push_back(static_cast<char>(bits & 0xFF));
+                bits >>= 8;
+                bitCount -= 8;
+            }
+        };
+        // 哈夫曼编码从高位开始写
+        auto putCode = [&](uint32_t code, int length) {
+            uint32_t reversed = 0;
+            for (int i = 0; i < length; ++i) {
+                reversed = (reversed << 1) | ((code >> i) & 1);
+            }
+            putBits(reversed, length);
+        };
+        auto putSymbol = [&](uint32_t symbol) {
+            if (symbol < 144) {
+                putCode(0x30 + symbol, 8);
+            }
+            else if (symbol < 256) {
+                putCode(0x190 + symbol - 144, 9);
+            }
+            else if (symbol < 280) {
+                putCode(symbol - 256, 7);
+            }
+            else {
+                putCode(0xC0 + symbol - 280, 8);
+            }
+        };
+        auto putMatch = [&](size_t length, size_t distance) {
+            int code = 28;
+            while (LENGTH_BASE[code] > length) {
+                --code;
+            }
+            putSymbol(257 + static_cast<uint32_t>(code));
+            putBits(static_cast<uint32_t>(length - LENGTH_BASE[code]), LENGTH_EXTRA[code]);
+            code = 29;
+            while (DIST_BASE[code] > distance) {
+                --code;
+            }
+            putCode(static_cast<uint32_t>(code), 5);
+            putBits(static_cast<uint32_t>(distance - DIST_BASE[code]), DIST_EXTRA[code]);
+        };
+
+        // BFINAL = 1, BTYPE = 01
+        putBits(1, 1);
+        putBits(1, 2);
+        const auto* bytes = reinterpret_cast<const uint8_t*>(data);
+        std::vector<int64_t> head(size_t(1) << HASH_BITS, -1);
+        std::vector<int64_t> prev(WINDOW, -1);
+        auto hashAt = [&](size_t pos) {
+            const uint32_t value = bytes[pos] | (bytes[pos + 1] << 8) | (bytes[pos + 2] << 16);
+            return (value * 2654435761u) >> (32 - HASH_BITS);
+        };
+        auto insert = [&](size_t pos) {
+            if (pos + MIN_MATCH <= size) {
+                const auto hash = hashAt(pos);
+                prev[pos % WINDOW] = head[hash];
+                head[hash] = static_cast<int64_t>(pos);
+            }
+        };
+        size_t pos = 0;
+        while (pos < size) {
+            size_t bestLength = 0;
+            size_t bestDistance = 0;
+            if (pos + MIN_MATCH <= size) {
+                const size_t maxLength = std::min(MAX_MATCH, size - pos);
+                int64_t candidate = head[hashAt(pos)];
+                for (int chain = 0; chain < MAX_CHAIN && candidate >= 0 && pos - static_cast<size_t>(candidate) <= WINDOW; ++chain) {
+                    const size_t from = static_cast<size_t>(candidate);
+                    size_t length = 0;
+                    while (length < maxLength && bytes[from + length] == bytes[pos + length]) {
+                        ++length;
+                    }
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = pos - from;
+                        if (length == maxLength) {
+                            break;
+                        }
+                    }
+                    const int64_t next = prev[from % WINDOW];
+                    // 链表里的位置已经被新的位置覆盖了
+                    if (next >= candidate) {
+                        break;
+                    }
+                    candidate = next;
+                }
+            }
+            if (bestLength >= MIN_MATCH) {
+                putMatch(bestLength, bestDistance);
+                for (size_t i = 0; i < bestLength; ++i) {
+                    insert(pos + i);
+                }
+                pos += bestLength;
+            }
+            else {
+                putSymbol(bytes[pos]);
+                insert(pos);
+                ++pos;
+            }
+        }
+        // 块结束
+        putSymbol(256);
+        if (bitCount > 0) {
+            putBits(0, 8 - bitCount);
+        }
+    }
+
+    // ============================= BinaryFileAppender
+    inline BinaryFileAppender::BinaryFileAppender()
+    {
+        setExtension(".qlb");
+    }
+
+    inline BinaryFileAppender::~BinaryFileAppender()
+    {
+        finishRepeats();
+    }
+
+    inline void BinaryFileAppender::onFileOpened()
+    {
+        // 字典是按文件的
+        _sites.clear();
+        _nextSiteId = 0;
+        _needHeader = true;
+    }
+
+    inline void BinaryFileAppender::encode(const Event::Ptr& event, std::string& out)
+    {
+        auto put = [&out](const auto& value) { out.append(reinterpret_cast<const char*>(&value), sizeof(value)); };
+        if (_needHeader) {
+            // 追加到已有的文件时不需要文件头
+            if (filesize() == 0) {
+                out.append(MAGIC, sizeof(MAGIC));
+            }
+            _needHeader = false;
+        }
+        const bool packed = !event->deferred.empty();
+        const std::string_view format = packed ? event->deferred.format() : std::string_view("%s");
+        const std::string_view signature = packed ? event->deferred.signature() : std::string_view("s");
+        const SiteView key{event->file, event->line, packed ? event->deferred.site() : nullptr};
+        auto it = _sites.find(key);
+        if (it == _sites.end() || it->second.format != format || it->second.signature != signature) {
+            Site site{_nextSiteId++, std::string(format), std::string(signature)};
+            out.push_back('S');
+            put(site.id);
+            put(event->line);
+            put(static_cast<uint16_t>(event->file.size()));
+            out.append(event->file);
+            put(static_cast<uint16_t>(signature.size()));
+            out.append(signature);
+            put(static_cast<uint32_t>(format.size()));
+            out.append(format);
+            if (it != _sites.end()) {
+                it->second = std::move(site);
+            }
+            else {
+                it = _sites.emplace(SiteKey{std::string(key.file), key.line, key.format}, std::move(site)).first;
+            }
+        }
+        out.push_back('E');
+        put(it->second.id);
+        put(event->timeNs);
+        put(event->threadId);
+        put(static_cast<uint8_t>(event->level));
+        if (packed) {
+            const auto args = event->deferred.args();
+            put(static_cast<uint32_t>(args.size()));
+            out.append(args);
+        }
+        else {
+            // 与字符串参数的打包格式相同
+            const auto content = event->content.view();
+            put(static_cast<uint32_t>(sizeof(uint32_t) + content.size() + 1));
+            put(static_cast<uint32_t>(content.size()));
+            out.append(content);
+            out.push_back('\0');
+        }
+    }
+
+    inline void BinaryFileAppender::renderArgs(std::string_view format, std::string_view signature, std::string_view args, std::string& out)
+    {
+        size_t argIndex = 0;
+        const char* data = args.data();
+        const char* end = args.data() + args.size();
+        auto read = [&](auto value) {
+            if (data + sizeof(value) > end) {
+                return decltype(value)();
+            }
+            std::memcpy(&value, data, sizeof(value));
+            data += sizeof(value);
+            return value;
+        };
+        // 取下一个参数，转成可变参数提升后的类型后调用emit
+        auto next = [&](auto&& emit) {
+            if (argIndex >= signature.size()) {
+                return false;
+            }
+            switch (signature[argIndex++]) {
+            case 'b': emit(static_cast<int>(read(int8_t()))); break;
+            case 'B': emit(static_cast<int>(read(uint8_t()))); break;
+            case 'h': emit(static_cast<int>(read(int16_t()))); break;
+            case 'H': emit(static_cast<int>(read(uint16_t()))); break;
+            case 'i': emit(read(int32_t())); break;
+            case 'I': emit(read(uint32_t())); break;
+            case 'q': emit(read(int64_t())); break;
+            case 'Q': emit(read(uint64_t())); break;
+            case 'f': emit(static_cast<double>(read(float()))); break;
+            case 'd': emit(read(double())); break;
+            case 'D': emit(read((long double)0)); break;
+            case 'p': emit(read(static_cast<const void*>(nullptr))); break;
+            case 's': {
+                const uint32_t length = read(uint32_t());
+                if (data + length + 1 > end) {
+                    return false;
+                }
+                emit(static_cast<const char*>(data));
+                data += length + 1;
+                break;
+            }
+            default: return false;
+            }
+            return true;
+        };
+        size_t i = 0;
+        while (i < format.size()) {
+            const char c = format[i];
+            if (c != '%') {
+                out += c;
+                ++i;
+                continue;
+            }
+            if (i + 1 < format.size() && format[i + 1] == '%') {
+                out += '%';
+                i += 2;
+                continue;
+            }
+            // 解析一个转换说明: %[flags][width][.precision][length]conversion
+            const size_t start = i++;
+            int stars[2];
+            int starCount = 0;
+            auto readStar = [&] {
+                if (i < format.size() && format[i] == '*') {
+                    ++i;
+                    int star = 0;
+                    next([&](auto value) {
+                        if constexpr (std::is_integral_v<decltype(value)>) {
+                            star = static_cast<int>(value);
+                        }
+                    });
+                    stars[starCount++] = star;
+                    return true;
+                }
+                return false;
+            };
+            while (i < format.size() && std::string_view("-+ #0").find(format[i]) != std::string_view::npos) {
+                ++i;
+            }
+            if (!readStar()) {
+                while (i < format.size() && std::isdigit(static_cast<unsigned char>(format[i]))) {
+                    ++i;
+                }
+            }
+            if (i < format.size() && format[i] == '.') {
+                ++i;
+                if (!readStar()) {
+                    while (i < format.size() && std::isdigit(static_cast<unsigned char>(format[i]))) {
+                        ++i;
+                    }
+                }
+            }
+            while (i < format.size() && std::string_view("hlLqjzt").find(format[i]) != std::string_view::npos) {
+                ++i;
+            }
+            if (i >= format.size()) {
+                out.append(format.substr(start));
+                break;
+            }
+            ++i;
+            const std::string spec(format.substr(start, i - start));
+            const bool ok = next([&](auto value) {
+                if (starCount == 2) {
+                    Utils::string_format_to(out, spec.c_str(), stars[0], stars[1], value);
+                }
+                else if (starCount == 1) {
+                    Utils::string_format_to(out, spec.c_str(), stars[0], value);
+                }
+                else {
+                    Utils::string_format_to(out, spec.c_str(), value);
+                }
+            });
+            if (!ok) {
+                out += spec;
+            }
+        }
+    }
+
+    inline bool BinaryFileAppender::decode(const std::string& filename, std::ostream& out, Formatter::Ptr formatter)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        const std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (data.size() < sizeof(MAGIC) || data.compare(0, sizeof(MAGIC), MAGIC, sizeof(MAGIC)) != 0) {
+            return false;
+        }
+        if (!formatter) {
+            formatter = std::make_shared<Formatter>();
+        }
+        struct DecodedSite
+        {
+            uint32_t line;
+            std::string file;
+            std::string signature;
+            std::string format;
+        };
+        std::unordered_map<uint32_t, DecodedSite> sites;
+        size_t pos = sizeof(MAGIC);
+        bool ok = true;
+        auto get = [&](auto& value) {
+            if (pos + sizeof(value) > data.size()) {
+                ok = false;
+                return;
+            }
+            std::memcpy(&value, data.data() + pos, sizeof(value));
+            pos += sizeof(value);
+        };
+        auto getString = [&](size_t length) {
+            if (!ok || pos + length > data.size()) {
+                ok = false;
+                return std::string_view();
+            }
+            const std::string_view str(data.data() + pos, length);
+            pos += length;
+            return str;
+        };
+        std::string line;
+        while (ok && pos < data.size()) {
+            const char type = data[pos++];
+            if (type == 'S') {
+                uint32_t id = 0;
+                DecodedSite site;
+                uint16_t fileLength = 0;
+                uint16_t signatureLength = 0;
+                uint32_t formatLength = 0;
+                get(id);
+                get(site.line);
+                get(fileLength);
+                site.file = getString(fileLength);
+                get(signatureLength);
+                site.signature = getString(signatureLength);
+                get(formatLength);
+                site.format = getString(formatLength);
+                if (ok) {
+                    sites[id] = std::move(site);
+                }
+            }
+            else if (type == 'E') {
+                uint32_t id = 0;
+                uint8_t level = 0;
+                uint32_t argsLength = 0;
+                auto event = Event::create();
+                get(id);
+                get(event->timeNs);
+                get(event->threadId);
+                get(level);
+                get(argsLength);
+                const auto args = getString(argsLength);
+                auto it = sites.find(id);
+                if (!ok || it == sites.end()) {
+                    ok = false;
+                    break;
+                }
+                event->time = event->timeNs / 1000000;
+                event->level = static_cast<Level>(level);
+                event->file = it->second.file;
+                event->line = it->second.line;
+                line.clear();
+                renderArgs(it->second.format, it->second.signature, args, line);
+                event->content.append(line);
+                line.clear();
+                formatter->formatTo(event, line);
+                out << line << '\n';
+            }
+            else {
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    // ============================= RoutingFileAppender
+    inline RoutingFileAppender::RoutingFileAppender()
+    {
+#ifdef USE_QT
+        _basePath = QApplication::applicationDirPath().toStdString() + "/";
+#endif
+        _basePath += "log";
+        setLevel(Level::Info);
+    }
+
+    inline RoutingFileAppender::~RoutingFileAppender()
+    {
+        finishRepeats();
+    }
+
+    inline void RoutingFileAppender::setBasePath(const std::string& basePath)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _basePath = basePath;
+    }
+
+    inline std::string RoutingFileAppender::basePath() const
+    {
+        return _basePath;
+    }
+
+    inline void RoutingFileAppender::setFileInitializer(const FileInitializer& initializer)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _initializer = initializer;
+    }
+
+    inline void RoutingFileAppender::setMaxOpenFiles(size_t count)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _maxOpenFiles = std::max<size_t>(count, 1);
+        evict();
+    }
+
+    inline void RoutingFileAppender::setFormatter(Formatter::Ptr formatter)
+    {
+        std::lock_guard lock(_mtxFlush);
+        _formatter = formatter;
+        for (auto& [name, route] : _routes) {
+            route.appender->setFormatter(formatter);
+        }
+    }
+
+    inline size_t RoutingFileAppender::openFiles()
+    {
+        std::lock_guard lock(_mtxFlush);
+        return _open.size();
+    }
+
+    inline void RoutingFileAppender::sanitize(std::string_view key)
+    {
+        _name.assign(key.empty() ? std::string_view("_") : key.substr(0, 128));
+        for (char& c : _name) {
+            if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_' && c != '.') {
+                c = '_';
+            }
+        }
+        // 不能跳到上层目录
+        if (_name == "." || _name == "..") {
+            _name = "_";
+        }
+    }
+
+    inline void RoutingFileAppender::evict()
+    {
+        while (_open.size() > _maxOpenFiles) {
+            Route* route = _open.back();
+            _open.pop_back();
+            route->open = _open.end();
+            route->appender->suspend();
+            collect(*route);
+        }
+    }
+
+    inline void RoutingFileAppender::collect(Route& route)
+    {
+        const auto& metrics = route.appender->metrics();
+        const uint64_t bytes = metrics.bytes.load(std::memory_order_relaxed);
+        const uint64_t rotations = metrics.rotations.load(std::memory_order_relaxed);
+        _metrics.bytes.fetch_add(bytes - std::exchange(route.bytes, bytes), std::memory_order_relaxed);
+        _metrics.rotations.fetch_add(rotations - std::exchange(route.rotations, rotations), std::memory_order_relaxed);
+    }
+
+    inline bool RoutingFileAppender::flush(const Event::Ptr event)
+    {
+        sanitize(event->key);
+        auto it = _routes.find(_name);
+        if (it == _routes.end()) {
+            auto appender = std::make_shared<FileAppender>();
+            appender->setBasePath(_basePath + "/" + _name);
+            appender->setFormatter(_formatter);
+            if (_initializer) {
+                _initializer(*appender);
+            }
+            it = _routes.emplace(_name, Route{std::move(appender), _open.end()}).first;
+        }
+        Route& route = it->second;
+        if (route.open != _open.end()) {
+            // 最近写过的移到最前面
+            _open.splice(_open.begin(), _open, route.open);
+        }
+        else {
+            _open.push_front(&route);
+            route.open = _open.begin();
+            evict();
+        }
+        const bool ok = route.appender->write(event);
+        collect(route);
+        return ok;
+    }
+
+    inline void RoutingFileAppender::onIdle()
+    {
+        for (Route* route : _open) {
+            route->appender->idle();
+            collect(*route);
+        }
+    }
+
+    inline void RoutingFileAppender::onCrash(std::string_view message, void* const* frames, int depth)
+    {
+        if (_open.empty()) {
+            return;
+        }
+        auto it = _open.begin();
+        (*it)->appender->onCrash(message, frames, depth);
+        for (++it; it != _open.end(); ++it) {
+            (*it)->appender->writeBufferOnCrash();
+        }
+    }
+
+    // ============================= RingFileAppender
+    inline RingFileAppender::~RingFileAppender()
+    {
+        finishRepeats();
+        close();
+    }
+
+    inline bool RingFileAppender::open(const std::string& filename, size_t capacity)
+    {
+        std::lock_guard lock(_mtxFlush);
+        close();
+        const size_t total = HEADER_SIZE + capacity;
+#ifdef QLOG_WINDOWS
+        _fileHandle = ::CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (_fileHandle == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize{};
+        ::GetFileSizeEx(_fileHandle, &fileSize);
+        const bool existing = static_cast<size_t>(fileSize.QuadPart) == total;
+        _mapping = ::CreateFileMappingA(_fileHandle, nullptr, PAGE_READWRITE, static_cast<DWORD>(uint64_t(total) >> 32), static_cast<DWORD>(total & 0xFFFFFFFFu), nullptr);
+        void* address = _mapping ? ::MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, total) : nullptr;
+        if (!address) {
+            close();
+            return false;
+        }
+#else
+        _fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (_fd < 0) {
+            return false;
+        }
+        struct stat st;
+        const bool existing = ::fstat(_fd, &st) == 0 && static_cast<size_t>(st.st_size) == total;
+        if (!existing && ::ftruncate(_fd, static_cast<off_t>(total)) != 0) {
+            close();
+            return false;
+        }
+        void* address = ::mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (address == MAP_FAILED) {
+            close();
+            return false;
+        }
+#endif
+        _mappedSize = total;
+        _header = static_cast<Header*>(address);
+        _data = static_cast<char*>(address) + HEADER_SIZE;
+        // 文件头不对就重新初始化
+        if (!existing || std::memcmp(_header->magic, MAGIC, sizeof(MAGIC)) != 0 || _header->version != VERSION
+            || _header->capacity != capacity || _header->writePos > capacity || _header->tailPos > capacity) {
+            std::memset(_header, 0, HEADER_SIZE);
+            std::memcpy(_header->magic, MAGIC, sizeof(MAGIC));
+            _header->version = VERSION;
+            _header->headerSize = HEADER_SIZE;
+            _header->capacity = capacity;
+        }
+        return true;
+    }
+
+    inline void RingFileAppender::close()
+    {
+#ifdef QLOG_WINDOWS
+        if (_header) {
+            ::UnmapViewOfFile(_header);
+        }
+        if (_mapping) {
+            ::CloseHandle(_mapping);
+            _mapping = nullptr;
+        }
+        if (_fileHandle != INVALID_HANDLE_VALUE) {
+            ::CloseHandle(_fileHandle);
+            _fileHandle = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (_header) {
+            ::munmap(_header, _mappedSize);
+        }
+        if (_fd >= 0) {
+            ::close(_fd);
+            _fd = -1;
+        }
+#endif
+        _header = nullptr;
+        _data = nullptr;
+        _mappedSize = 0;
+    }
+
+    inline bool RingFileAppender::flush(const Event::Ptr event)
+    {
+        if (!_header) {
+            return false;
+        }
+        const auto& line = render(event);
+        // 一条日志最多占满整个数据区
+        const size_t maxSize = _header->capacity - 2 * sizeof(uint32_t);
+        const auto size = static_cast<uint32_t>(std::min(line.size(), maxSize));
+        append(line.data(), size);
+        _metrics.bytes.fetch_add(size, std::memory_order_relaxed);
+        return true;
     }
 
-    inline std::string FileAppender::path() const
+    inline uint32_t RingFileAppender::readLength(uint64_t pos) const
     {
-        return _path;
+        if (pos + sizeof(uint32_t) > _header->capacity) {
+            return WRAP_MARKER;
+        }
+        uint32_t length;
+        std::memcpy(&length, _data + pos, sizeof(length));
+        return length;
     }
 
-    inline std::string FileAppender::basePath() const
+    inline void RingFileAppender::advanceTail()
     {
-        return _basePath;
+        const uint32_t length = readLength(_header->tailPos);
+        if (length == WRAP_MARKER) {
+            _header->tailPos = 0;
+            return;
+        }
+        _header->tailPos += sizeof(uint32_t) + length;
     }
 
-    inline bool FileAppender::resetFile(Event::Ptr event)
+    inline void RingFileAppender::append(const char* data, uint32_t size)
     {
-        if (_fileSplitPolicy == nullptr) {
-            _fileSplitPolicy = [](Event::Ptr evt, FileAppender& appender) {
-                std::tm time;
-                const auto sTime = evt->time / 1000;
-                gmtime_s(&time, &sTime);
-                int year = time.tm_year + 1900;
-                int month = time.tm_mon + 1;
-                int day = time.tm_mday;
-                // 根据年月重新设置路径
-                const std::string monthPath = std::format("{}/{}/{}/", appender.basePath().c_str(), year, month);
-                if (monthPath != appender.path()) {
-                    std::filesystem::create_directories(monthPath);
-                    appender.setPath(monthPath);
-                }
-                // 年月日发生了变化就会产生一个新的文件名, 如果文件名发生了变化就重新创建文件
-                std::string dayFilename = std::format("{}-{}-{}.log", year, month, day);
-                if (dayFilename != appender.filename()
-                    // 这种实现不太好，如果软件崩溃了，就会产生新的日志文件。
-                    && dayFilename.compare(0, dayFilename.length() - 4, appender.filename().substr(0, dayFilename.length() - 4)) != 0) {
-                    return dayFilename;
-                }
-                // 如果文件名没有发生变化，但是如果文件大小超出阈值
-                double filesize = appender.filesize() / 1024.0 / 1024.0;
-                if (filesize > 10.0 MB) {
-                    //
-                    return std::format("{}-{}-{}_{}_{}_{}.log",
-                        year,
-                        month,
-                        day,
-                        //
-                        time.tm_hour,
-                        time.tm_min,
-                        time.tm_sec);
-                }
-                // 使用原始文件名，就不进行分割了
-                return appender.filename();
-            };
-        }
-        std::string newFilename = _fileSplitPolicy(event, *this);
-        // 如果文件名发生了变化就重新创建文件
-        if (_filename != newFilename || !_file.is_open()) {
-            if (_file.is_open()) {
-                _file.flush();
-                _file.close();
+        // 有效数据: tail <= write 时为[tail, write); tail > write 时为[tail, 回绕标记) + [0, write)
+        const uint64_t capacity = _header->capacity;
+        const uint64_t need = sizeof(uint32_t) + size;
+        uint64_t write = _header->writePos;
+        // tail不能正好等于新的write, 否则分不清是空还是满, 所以用<=多丢一条
+        if (write + need > capacity) {
+            // 末尾放不下，write之后的旧数据段整个丢掉, 在write处写回绕标记后回到开头
+            if (_header->tailPos > write) {
+                _header->tailPos = 0;
             }
-            //
-            _file.open(_path + newFilename, std::fstream::out | std::fstream::app | std::fstream::ate);
-            _file.seekp(0);
-            if (_file.fail()) {
-                return false;
+            if (write + sizeof(uint32_t) <= capacity) {
+                std::memcpy(_data + write, &WRAP_MARKER, sizeof(WRAP_MARKER));
             }
-            _filename = newFilename;
+            while (_header->tailPos <= need && _header->tailPos != write) {
+                advanceTail();
+            }
+            if (_header->tailPos == write) {
+                // 旧数据全部被覆盖
+                _header->tailPos = 0;
+            }
+            write = 0;
         }
-        return true;
+        else if (_header->tailPos > write) {
+            // 覆盖最旧的数据段
+            while (_header->tailPos > write && _header->tailPos <= write + need) {
+                advanceTail();
+            }
+        }
+        // 先移动tail再写数据，最后更新write，崩溃时读者最多丢掉正在写的这一条
+        std::memcpy(_data + write, &size, sizeof(size));
+        std::memcpy(_data + write + sizeof(size), data, size);
+        _header->writePos = write + need;
     }
 
-    inline bool FileAppender::flush(const Event::Ptr event)
+    inline std::vector<std::string> RingFileAppender::read(const std::string& filename)
     {
-        if (!resetFile(event)) {
-            return false;
+        std::vector<std::string> records;
+        std::ifstream file(filename, std::ios::binary);
+        Header header{};
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+            || header.version != VERSION) {
+            return records;
         }
-        auto formatter = getFormatter(event);
-        _file << formatter->format(event) << "\n";
-        _file.flush();
-        return true;
+        std::string data(header.capacity, '\0');
+        file.seekg(header.headerSize);
+        if (!file.read(data.data(), static_cast<std::streamsize>(data.size()))) {
+            return records;
+        }
+        auto readSegment = [&](uint64_t pos, uint64_t end) {
+            while (pos < end && pos + sizeof(uint32_t) <= header.capacity) {
+                uint32_t length;
+                std::memcpy(&length, data.data() + pos, sizeof(length));
+                if (length == WRAP_MARKER || pos + sizeof(uint32_t) + length > header.capacity) {
+                    break;
+                }
+                records.emplace_back(data.data() + pos + sizeof(uint32_t), length);
+                pos += sizeof(uint32_t) + length;
+            }
+        };
+        if (header.tailPos <= header.writePos) {
+            readSegment(header.tailPos, header.writePos);
+        }
+        else {
+            readSegment(header.tailPos, header.capacity);
+            readSegment(0, header.writePos);
+        }
+        return records;
     }
 
     template <class T>
@@ -768,10 +5179,12 @@ namespace ray::log
 #ifdef USE_QT
         // 判断是不是QString,
         if constexpr (std::is_same_v<std::decay_t<T>, QString>) {
+            _logEvent->prepareAppend();
             _logEvent->content << s.toStdString();
         }
         else {
 #endif
+            _logEvent->prepareAppend();
             _logEvent->content << s;
 #ifdef USE_QT
         }
@@ -792,10 +5205,22 @@ namespace ray::log
         return *this;
     }
 
+    template <typename T>
+    inline Logger& Logger::with(std::string_view key, const T& value)
+    {
+        _logEvent->fields.add(key, value);
+        return *this;
+    }
+
     inline Logger& Logger::set_appenders(std::list<std::string> appenders)
     {
-        _appenders.clear();
-        _appenders = std::move(appenders);
+        _logEvent->appenders = appenders.empty() ? 0 : AppenderRegistry::instance().mask(appenders);
+        return *this;
+    }
+
+    inline Logger& Logger::set_appenders(AppenderMask appenders)
+    {
+        _logEvent->appenders = appenders;
         return *this;
     }
 
@@ -805,15 +5230,15 @@ namespace ray::log
         return *this;
     }
 
-    inline Logger& Logger::set_file(std::string file)
+    inline Logger& Logger::set_file(std::string_view file)
     {
-        _logEvent->file = Utils::getFilename(file);
+        _logEvent->setFile(Utils::getFilename(file));
         return *this;
     }
 
-    inline Logger& Logger::set_key(const std::string& key)
+    inline Logger& Logger::set_key(std::string_view key)
     {
-        _logEvent->key = key;
+        _logEvent->setKey(key);
         return *this;
     }
 
@@ -827,6 +5252,15 @@ namespace ray::log
     template <typename T, typename... Args>
     void ray::log::Logger::log(T format, Args... args)
     {
+#if QLOG_DEFERRED_FORMAT
+        if constexpr ((std::is_same_v<T, const char*> || std::is_same_v<T, char*>) && DeferredArgs::supported<Args...>()) {
+            // 只有第一段内容可以延迟，否则会打乱内容顺序
+            if (_logEvent->empty() && _logEvent->deferred.capture(format, args...)) {
+                return;
+            }
+        }
+#endif
+        _logEvent->prepareAppend();
         if constexpr (std::is_same_v<std::decay_t<T>, std::string>) {
             _logEvent->content << Utils::string_format(format.c_str(), std::forward<Args>(args)...);
         }
@@ -840,6 +5274,13 @@ namespace ray::log
         }
     }
 
+    template <typename... Args>
+    void Logger::fmt(std::format_string<Args...> format, Args&&... args)
+    {
+        _logEvent->prepareAppend();
+        std::format_to(std::ostreambuf_iterator<char>(_logEvent->content), format, std::forward<Args>(args)...);
+    }
+
     template <typename T, typename... Args>
     void Logger::debug(T format, Args... args)
     {
@@ -879,6 +5320,9 @@ namespace ray::log
     std::string Logger::format(T message, Formatter::Ptr formatter)
     {
         log<T>(std::forward<T>(message));
+        _logEvent->resolveTime();
+        // 不经过dispatch, 要自己格式化延迟的参数
+        _logEvent->materialize();
         if (formatter) {
             return formatter->format(_logEvent);
         }
@@ -901,6 +5345,24 @@ namespace ray::log
         return duration;
     }
 
+    template <typename... Args>
+    void Utils::string_format_to(std::string& out, const char* format, Args... args)
+    {
+        char buf[512];
+        const int size = std::snprintf(buf, sizeof(buf), format, args...);
+        if (size <= 0) {
+            return;
+        }
+        if (static_cast<size_t>(size) < sizeof(buf)) {
+            out.append(buf, static_cast<size_t>(size));
+            return;
+        }
+        const auto offset = out.size();
+        out.resize(offset + size + 1);
+        std::snprintf(out.data() + offset, size + 1, format, args...);
+        out.resize(offset + size);
+    }
+
     template <typename... Args>
     std::string Utils::string_format(const char* format, Args... args)
     {
@@ -915,15 +5377,489 @@ namespace ray::log
         return std::string(buf.get(), buf.get() + size - 1); // We don't want the '\0' inside
     }
 
+    //=========================    Stream
+    inline void Stream::reset()
+    {
+        _buffer.reset();
+        std::ostream::clear();
+        // 上一条日志设置的std::hex、setprecision等不能带到复用它的日志
+        flags(std::ios::dec | std::ios::skipws);
+        precision(6);
+        width(0);
+        fill(' ');
+        // imbue比较慢, 只在改过时恢复
+        if (getloc() != std::locale()) {
+            imbue(std::locale());
+        }
+    }
+
+    inline std::string_view Stream::Buffer::view() const
+    {
+        if (_spilled) {
+            return _heap;
+        }
+        return std::string_view(pbase(), static_cast<size_t>(pptr() - pbase()));
+    }
+
+    inline void Stream::Buffer::reset()
+    {
+        _spilled = false;
+        _heap.clear();
+        // 偶尔的超长日志不要一直占着内存
+        if (_heap.capacity() > 64 * 1024) {
+            _heap.shrink_to_fit();
+        }
+        setp(_inline, _inline + sizeof(_inline));
+    }
+
+    inline void Stream::Buffer::spill()
+    {
+        _heap.assign(pbase(), pptr());
+        _spilled = true;
+        // 之后的写入都走overflow/xsputn
+        setp(nullptr, nullptr);
+    }
+
+    inline Stream::Buffer::int_type Stream::Buffer::overflow(int_type ch)
+    {
+        if (!_spilled) {
+            spill();
+        }
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            _heap.push_back(traits_type::to_char_type(ch));
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    inline std::streamsize Stream::Buffer::xsputn(const char* s, std::streamsize n)
+    {
+        if (!_spilled) {
+            if (n <= epptr() - pptr()) {
+                std::memcpy(pptr(), s, static_cast<size_t>(n));
+                pbump(static_cast<int>(n));
+                return n;
+            }
+            spill();
+        }
+        _heap.append(s, static_cast<size_t>(n));
+        return n;
+    }
+
+    //=========================    ObjectPool
+    template <typename T>
+    std::mutex& ObjectPool<T>::orphanMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    template <typename T>
+    std::vector<ObjectPool<T>*>& ObjectPool<T>::orphans()
+    {
+        // 不析构，退出时其他线程可能还在归还对象
+        static auto* pools = new std::vector<ObjectPool*>();
+        return *pools;
+    }
+
+    template <typename T>
+    ObjectPool<T>::Guard::~Guard()
+    {
+        if (_local) {
+            std::lock_guard lock(orphanMutex());
+            orphans().push_back(_local);
+            _local = nullptr;
+        }
+    }
+
+    template <typename T>
+    ObjectPool<T>* ObjectPool<T>::local()
+    {
+        if (_local) {
+            return _local;
+        }
+        // guard在线程退出时把池交出去; 之后再取对象就直接new
+        static thread_local bool initialized = false;
+        if (initialized) {
+            return nullptr;
+        }
+        initialized = true;
+        static thread_local Guard guard;
+        (void)guard;
+        {
+            std::lock_guard lock(orphanMutex());
+            if (!orphans().empty()) {
+                _local = orphans().back();
+                orphans().pop_back();
+            }
+        }
+        if (!_local) {
+            _local = new ObjectPool();
+        }
+        return _local;
+    }
+
+    template <typename T>
+    T* ObjectPool<T>::acquire()
+    {
+        ObjectPool* pool = local();
+        if (!pool) {
+            return new Node();
+        }
+        if (!pool->_free) {
+            // 取回其他线程归还的对象
+            pool->_free = pool->_remote.exchange(nullptr, std::memory_order_acquire);
+        }
+        Node* node = pool->_free;
+        if (node) {
+            pool->_free = node->next;
+        }
+        else {
+            node = new Node();
+            node->owner = pool;
+        }
+        return node;
+    }
+
+    template <typename T>
+    void ObjectPool<T>::release(T* object)
+    {
+        Node* node = static_cast<Node*>(object);
+        ObjectPool* owner = node->owner;
+        if (!owner) {
+            delete node;
+            return;
+        }
+        if (owner == _local) {
+            node->next = owner->_free;
+            owner->_free = node;
+            return;
+        }
+        node->next = owner->_remote.load(std::memory_order_relaxed);
+        while (!owner->_remote.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+
+    template <typename T>
+    T* PoolAllocator<T>::allocate(size_t n)
+    {
+        if (n != 1) {
+            return std::allocator<T>().allocate(n);
+        }
+        return reinterpret_cast<T*>(ObjectPool<Storage>::acquire());
+    }
+
+    template <typename T>
+    void PoolAllocator<T>::deallocate(T* p, size_t n)
+    {
+        if (n != 1) {
+            std::allocator<T>().deallocate(p, n);
+            return;
+        }
+        ObjectPool<Storage>::release(reinterpret_cast<Storage*>(p));
+    }
+
+    //=========================    Event
+    inline Event::Ptr Event::create()
+    {
+        return Ptr(ObjectPool<Event>::acquire(),
+            [](Event* event) {
+            event->reset();
+            ObjectPool<Event>::release(event);
+        },
+            PoolAllocator<Event>());
+    }
+
+    inline void Event::setFile(std::string_view file)
+    {
+        _fileStorage.assign(file);
+        this->file = _fileStorage;
+    }
+
+    inline void Event::setKey(std::string_view key)
+    {
+        _keyStorage.assign(key);
+        this->key = _keyStorage;
+    }
+
+    inline void Event::materialize()
+    {
+        if (!deferred.empty() && !deferred.rendered()) {
+            // 复用线程局部的缓冲区
+            thread_local std::string message;
+            message.clear();
+            deferred.render(message);
+            deferred.setRendered();
+            content.append(message);
+        }
+    }
+
+    inline void Event::prepareAppend()
+    {
+        materialize();
+        deferred.clear();
+    }
+
+    inline void Event::resolveTime()
+    {
+        if (ticks != 0) {
+            timeNs = Clock::toNanoseconds(ticks);
+            time = timeNs / 1000000;
+            ticks = 0;
+        }
+    }
+
+    inline void Event::reset()
+    {
+        time = 0;
+        timeNs = 0;
+        level = Level::Debug;
+        code = 0;
+        line = 0;
+        file = {};
+        ticks = 0;
+        threadId = 0;
+        threadName = {};
+        content.reset();
+        deferred.clear();
+        fields.clear();
+        formatter.reset();
+        key = "global";
+        appenders = 0;
+    }
+
+    //=========================    Fields
+    // 每个字段: u8 类型, u8 key长度, key, 值(数值原样保存, 字符串为u32长度 + 内容)
+    template <typename T>
+    bool Fields::add(std::string_view key, const T& value)
+    {
+        if constexpr (std::is_same_v<T, bool>) {
+            return append(key, Type::Bool, &value, sizeof(value));
+        }
+        else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+            const int64_t v = value;
+            return append(key, Type::Int, &v, sizeof(v));
+        }
+        else if constexpr (std::is_integral_v<T>) {
+            const uint64_t v = value;
+            return append(key, Type::UInt, &v, sizeof(v));
+        }
+        else if constexpr (std::is_enum_v<T>) {
+            return add(key, static_cast<std::underlying_type_t<T>>(value));
+        }
+        else if constexpr (std::is_floating_point_v<T>) {
+            const double v = value;
+            return append(key, Type::Double, &v, sizeof(v));
+        }
+        else {
+            static_assert(std::is_convertible_v<const T&, std::string_view>, "field value must be a number, bool or string");
+            const std::string_view v = value;
+            return append(key, Type::String, v.data(), v.size());
+        }
+    }
+
+    inline bool Fields::append(std::string_view key, Type type, const void* value, size_t size)
+    {
+        key = key.substr(0, UINT8_MAX);
+        const size_t header = 2 + key.size() + (type == Type::String ? sizeof(uint32_t) : 0);
+        if (_size + header + size > sizeof(_data)) {
+            return false;
+        }
+        std::byte* out = _data + _size;
+        out[0] = static_cast<std::byte>(type);
+        out[1] = static_cast<std::byte>(key.size());
+        std::memcpy(out + 2, key.data(), key.size());
+        out += 2 + key.size();
+        if (type == Type::String) {
+            const auto length = static_cast<uint32_t>(size);
+            std::memcpy(out, &length, sizeof(length));
+            out += sizeof(length);
+        }
+        std::memcpy(out, value, size);
+        _size += static_cast<uint32_t>(header + size);
+        return true;
+    }
+
+    template <typename F>
+    void Fields::forEach(F&& f) const
+    {
+        const std::byte* in = _data;
+        const std::byte* end = _data + _size;
+        while (in < end) {
+            Value value;
+            value.type = static_cast<Type>(in[0]);
+            const auto keyLength = static_cast<size_t>(in[1]);
+            const std::string_view key(reinterpret_cast<const char*>(in + 2), keyLength);
+            in += 2 + keyLength;
+            switch (value.type) {
+            case Type::Int: std::memcpy(&value.i, in, sizeof(value.i)); in += sizeof(value.i); break;
+            case Type::UInt: std::memcpy(&value.u, in, sizeof(value.u)); in += sizeof(value.u); break;
+            case Type::Double: std::memcpy(&value.d, in, sizeof(value.d)); in += sizeof(value.d); break;
+            case Type::Bool: std::memcpy(&value.b, in, sizeof(value.b)); in += sizeof(value.b); break;
+            case Type::String: {
+                uint32_t length;
+                std::memcpy(&length, in, sizeof(length));
+                in += sizeof(length);
+                value.s = std::string_view(reinterpret_cast<const char*>(in), length);
+                in += length;
+                break;
+            }
+            }
+            f(key, value);
+        }
+    }
+
+    //=========================    DeferredArgs
+    // 每种参数类型如何拷贝进缓冲区，以及如何还原成snprintf能接受的参数
+    template <typename T>
+    struct DeferredArgs::Packer
+    {
+        static constexpr bool supported = std::is_arithmetic_v<T> || std::is_enum_v<T> || std::is_pointer_v<T>;
+        static constexpr char typeCode()
+        {
+            if constexpr (std::is_pointer_v<T>) {
+                return 'p';
+            }
+            else if constexpr (std::is_enum_v<T>) {
+                return Packer<std::underlying_type_t<T>>::code;
+            }
+            else if constexpr (std::is_floating_point_v<T>) {
+                return sizeof(T) == sizeof(float) ? 'f' : (sizeof(T) == sizeof(double) ? 'd' : 'D');
+            }
+            else {
+                constexpr char codes[] = {'b', 'h', 'i', 'q'};
+                constexpr char code = codes[std::bit_width(sizeof(T)) - 1];
+                return std::is_signed_v<T> ? code : static_cast<char>(code - 'a' + 'A');
+            }
+        }
+        static constexpr char code = typeCode();
+        static size_t size(const T&) { return sizeof(T); }
+        static void write(std::byte*& out, const T& value)
+        {
+            std::memcpy(out, &value, sizeof(T));
+            out += sizeof(T);
+        }
+        static T read(const std::byte*& in)
+        {
+            T value;
+            std::memcpy(&value, in, sizeof(T));
+            in += sizeof(T);
+            return value;
+        }
+    };
+
+    // 字符串拷贝内容, 还原为指向缓冲区的const char*
+    template <>
+    struct DeferredArgs::Packer<std::string_view>
+    {
+        static constexpr bool supported = true;
+        static constexpr char code = 's';
+        static size_t size(std::string_view value) { return sizeof(uint32_t) + value.size() + 1; }
+        static void write(std::byte*& out, std::string_view value)
+        {
+            const auto length = static_cast<uint32_t>(value.size());
+            std::memcpy(out, &length, sizeof(length));
+            out += sizeof(length);
+            std::memcpy(out, value.data(), length);
+            out[length] = std::byte{0};
+            out += length + 1;
+        }
+        static const char* read(const std::byte*& in)
+        {
+            uint32_t length;
+            std::memcpy(&length, in, sizeof(length));
+            const auto str = reinterpret_cast<const char*>(in + sizeof(length));
+            in += sizeof(length) + length + 1;
+            return str;
+        }
+    };
+
+    template <>
+    struct DeferredArgs::Packer<const char*> : DeferredArgs::Packer<std::string_view>
+    {
+        static size_t size(const char* value) { return Packer<std::string_view>::size(value ? value : "(null)"); }
+        static void write(std::byte*& out, const char* value) { Packer<std::string_view>::write(out, value ? value : "(null)"); }
+    };
+
+    template <>
+    struct DeferredArgs::Packer<char*> : DeferredArgs::Packer<const char*>
+    { };
+
+    template <>
+    struct DeferredArgs::Packer<std::string> : DeferredArgs::Packer<std::string_view>
+    { };
+
+    template <typename... Args>
+    constexpr bool DeferredArgs::supported()
+    {
+        return (Packer<Args>::supported && ...);
+    }
+
+    template <typename... Args>
+    bool DeferredArgs::capture(const char* format, const Args&... args)
+    {
+        const size_t size = Packer<const char*>::size(format) + (Packer<Args>::size(args) + ... + 0);
+        if (size > sizeof(_data)) {
+            return false;
+        }
+        std::byte* out = _data;
+        Packer<const char*>::write(out, format);
+        (Packer<Args>::write(out, args), ...);
+        _render = &DeferredArgs::renderImpl<Args...>;
+        _site = format;
+        _signature = signatureOf<Args...>();
+        _size = static_cast<uint32_t>(size);
+        _rendered = false;
+        return true;
+    }
+
+    template <typename... Args>
+    const char* DeferredArgs::signatureOf()
+    {
+        static constexpr char signature[] = {Packer<Args>::code..., '\0'};
+        return signature;
+    }
+
+    inline std::string_view DeferredArgs::format() const
+    {
+        const std::byte* data = _data;
+        const char* format = Packer<const char*>::read(data);
+        return std::string_view(format, static_cast<size_t>(reinterpret_cast<const char*>(data) - format) - 1);
+    }
+
+    inline std::string_view DeferredArgs::args() const
+    {
+        const std::byte* data = _data;
+        Packer<const char*>::read(data);
+        return std::string_view(reinterpret_cast<const char*>(data), static_cast<size_t>(_data + _size - data));
+    }
+
+    template <typename... Args>
+    void DeferredArgs::renderImpl(const std::byte* data, std::string& out)
+    {
+        const char* format = Packer<const char*>::read(data);
+        // 花括号初始化保证参数按顺序读取
+        std::tuple<decltype(Packer<Args>::read(data))...> values{Packer<Args>::read(data)...};
+        std::apply([&](auto... values) { Utils::string_format_to(out, format, values...); }, values);
+    }
+
+    inline void DeferredArgs::render(std::string& out) const
+    {
+        if (_render) {
+            _render(_data, out);
+        }
+    }
+
     // =======================  便捷方法 ========================
     static Logger console(Level level = Level::Debug, const std::source_location& location = std::source_location::current())
     {
-        return Logger(location.file_name(), location.line(), level, { "console" });
+        static const AppenderMask appenders = AppenderRegistry::instance().mask({"console"});
+        return Logger(location.file_name(), location.line(), level, appenders);
     }
 
     static Logger file(Level level = Level::Info, const std::source_location& location = std::source_location::current())
     {
-        return Logger(location.file_name(), location.line(), level, { "file" });
+        static const AppenderMask appenders = AppenderRegistry::instance().mask({"file"});
+        return Logger(location.file_name(), location.line(), level, appenders);
     }
 
     static Logger log(Level level = Level::Info, const std::source_location& location = std::source_location::current())
@@ -931,4 +5867,58 @@ namespace ray::log
         return Logger(location.file_name(), location.line(), level);
     }
 } // namespace ray::log
+
+// =======================  日志宏 ========================
+// 先做运行期级别判断再构造Logger, 被过滤掉的日志不会求值任何参数。
+// 用法: QLOG_DEBUG("hello %s", name); QLOG(ray::log::Level::Info) << expensive();
+#define QLOG(level)                                                                                     \
+    if (static_cast<int>(level) < QLOG_ACTIVE_LEVEL || !::ray::log::shouldLog(level)) {                 \
+    }                                                                                                   \
+    else                                                                                                \
+        ::ray::log::Logger(__FILE__, __LINE__, level)
+
+// 按调用位置限流, 状态是该位置的静态变量, 被丢弃的日志不会构造Logger也不会求值参数。
+// 用法: QLOG_EVERY_N(ray::log::Level::Error, 1000).log("connect failed: %d", err);
+//       QLOG_RATE_LIMIT(ray::log::Level::Error, 10) << "timeout " << id;  每秒最多10条
+//       QLOG_FIRST_N(ray::log::Level::Warning, 3) << "deprecated";
+#define QLOG_SITE_(level, check)                                                                                  \
+    if (static ::ray::log::LogSite qlogSite_{__FILE__, __LINE__, level};                                          \
+        static_cast<int>(level) < QLOG_ACTIVE_LEVEL || !::ray::log::shouldLog(level) || !qlogSite_.check) {      \
+    }                                                                                                             \
+    else                                                                                                          \
+        qlogSite_.annotate(::ray::log::Logger(__FILE__, __LINE__, level))
+
+#define QLOG_EVERY_N(level, n) QLOG_SITE_(level, everyN(n))
+#define QLOG_FIRST_N(level, n) QLOG_SITE_(level, firstN(n))
+#define QLOG_RATE_LIMIT(level, perSecond) QLOG_SITE_(level, rateLimit(perSecond))
+
+#if QLOG_ACTIVE_LEVEL <= QLOG_LEVEL_DEBUG
+#define QLOG_DEBUG(...) QLOG(::ray::log::Level::Debug).log(__VA_ARGS__)
+#else
+#define QLOG_DEBUG(...) (void)0
+#endif
+
+#if QLOG_ACTIVE_LEVEL <= QLOG_LEVEL_INFO
+#define QLOG_INFO(...) QLOG(::ray::log::Level::Info).log(__VA_ARGS__)
+#else
+#define QLOG_INFO(...) (void)0
+#endif
+
+#if QLOG_ACTIVE_LEVEL <= QLOG_LEVEL_WARNING
+#define QLOG_WARNING(...) QLOG(::ray::log::Level::Warning).log(__VA_ARGS__)
+#else
+#define QLOG_WARNING(...) (void)0
+#endif
+
+#if QLOG_ACTIVE_LEVEL <= QLOG_LEVEL_ERROR
+#define QLOG_ERROR(...) QLOG(::ray::log::Level::Error).log(__VA_ARGS__)
+#else
+#define QLOG_ERROR(...) (void)0
+#endif
+
+#if QLOG_ACTIVE_LEVEL <= QLOG_LEVEL_FATAL
+#define QLOG_FATAL(...) QLOG(::ray::log::Level::Fatal).log(__VA_ARGS__)
+#else
+#define QLOG_FATAL(...) (void)0
+#endif
 #endif // !__RAY_QLOG_HPP__
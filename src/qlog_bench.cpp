@@ -0,0 +1,285 @@
+﻿#include <algorithm>
+#include <barrier>
+#include <fstream>
+#include <iostream>
+#include "qlog.h"
+
+// qlog性能测试, 测量每次调用的延迟分位数和总吞吐量, 结果每个用例一行JSON, 方便比较不同版本。
+// 用法: qlog_bench [--threads=1,2,4] [--iterations=20000] [--appenders=null,file,console]
+//                  [--sizes=16,128,1024] [--modes=sync,async] [--dir=bench_log] [--output=qlog_bench.jsonl]
+// console用例会写到stdout, 结果写到--output, 同时在stderr输出一份表格。
+
+using namespace ray;
+
+namespace
+{
+    // 只格式化不输出, 用来测量日志本身的开销
+    class NullAppender : public log::Appender
+    {
+    public:
+        NullAppender() { _level = log::Level::Info; }
+        bool flush(const log::Event::Ptr event) override
+        {
+            render(event);
+            return true;
+        }
+    };
+
+    struct Options
+    {
+        std::vector<size_t> threads;
+        size_t iterations = 20000;
+        std::vector<std::string> appenders = {"null", "file", "console"};
+        std::vector<size_t> sizes = {16, 128, 1024};
+        std::vector<std::string> modes = {"sync", "async"};
+        std::string dir = "bench_log";
+        std::string output = "qlog_bench.jsonl";
+    };
+
+    struct Case
+    {
+        std::string appender;
+        std::string mode;
+        size_t threads;
+        // 日志级别低于appender的级别, 在shouldLog处被过滤
+        bool filtered;
+        // printf风格的log()或者operator<<
+        bool printfApi;
+        size_t size;
+    };
+
+    struct Result
+    {
+        size_t calls = 0;
+        double seconds = 0;
+        // 异步模式下包括等后台线程写完
+        double drainSeconds = 0;
+        uint64_t p50 = 0;
+        uint64_t p90 = 0;
+        uint64_t p99 = 0;
+        uint64_t p999 = 0;
+        uint64_t max = 0;
+    };
+
+    std::vector<std::string> split(std::string_view text)
+    {
+        std::vector<std::string> items;
+        size_t start = 0;
+        while (start <= text.size()) {
+            const size_t end = std::min(text.find(',', start), text.size());
+            if (end > start) {
+                items.emplace_back(text.substr(start, end - start));
+            }
+            start = end + 1;
+        }
+        return items;
+    }
+
+    std::vector<size_t> splitNumbers(std::string_view text)
+    {
+        std::vector<size_t> numbers;
+        for (const auto& item : split(text)) {
+            numbers.push_back(std::stoul(item));
+        }
+        return numbers;
+    }
+
+    bool parse(int argc, char* argv[], Options& options)
+    {
+        for (int i = 1; i < argc; ++i) {
+            const std::string_view arg = argv[i];
+            const size_t eq = arg.find('=');
+            if (arg.substr(0, 2) != "--" || eq == std::string_view::npos) {
+                return false;
+            }
+            const auto name = arg.substr(2, eq - 2);
+            const auto value = arg.substr(eq + 1);
+            if (name == "threads") {
+                options.threads = splitNumbers(value);
+            }
+            else if (name == "iterations") {
+                options.iterations = std::stoul(std::string(value));
+            }
+            else if (name == "appenders") {
+                options.appenders = split(value);
+            }
+            else if (name == "sizes") {
+                options.sizes = splitNumbers(value);
+            }
+            else if (name == "modes") {
+                options.modes = split(value);
+            }
+            else if (name == "dir") {
+                options.dir = value;
+            }
+            else if (name == "output") {
+                options.output = value;
+            }
+            else {
+                return false;
+            }
+        }
+        if (options.threads.empty()) {
+            // 默认1, 2, 4...直到CPU核数
+            const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+            for (size_t n = 1; n < cores; n *= 2) {
+                options.threads.push_back(n);
+            }
+            options.threads.push_back(cores);
+        }
+        return true;
+    }
+
+    log::Appender::Ptr createAppender(const std::string& name, const Options& options)
+    {
+        if (name == "null") {
+            return std::make_shared<NullAppender>();
+        }
+        if (name == "file") {
+            auto appender = std::make_shared<log::FileAppender>();
+            appender->setBasePath(options.dir);
+            appender->setLevel(log::Level::Info);
+            return appender;
+        }
+        if (name == "console") {
+            auto appender = std::make_shared<log::ConsoleAppender>();
+            appender->setLevel(log::Level::Info);
+            return appender;
+        }
+        return nullptr;
+    }
+
+    Result run(const Case& c, const Options& options)
+    {
+        using Clock = std::chrono::steady_clock;
+        auto appender = createAppender(c.appender, options);
+        auto& registry = log::AppenderRegistry::instance();
+        registry.clear();
+        log::AppenderFactory::instance().registerCreateMethod("bench", [appender] { return appender; });
+        registry.addAppenders({"bench"});
+        const log::AppenderMask mask = registry.mask({"bench"});
+        if (c.mode == "async") {
+            log::AsyncWorker::instance().start();
+        }
+
+        const log::Level level = c.filtered ? log::Level::Debug : log::Level::Info;
+        const std::string payload(c.size, 'x');
+        // 和QLOG宏一样先判断级别
+        auto call = [&](size_t i) {
+            if (!log::shouldLog(level)) {
+                return;
+            }
+            if (c.printfApi) {
+                log::Logger(__FILE__, __LINE__, level, mask).log("bench %zu %s", i, payload.c_str());
+            }
+            else {
+                log::Logger(__FILE__, __LINE__, level, mask) << "bench " << i << ' ' << payload;
+            }
+        };
+
+        std::vector<std::vector<uint32_t>> latencies(c.threads);
+        // 每个线程自己的开始和结束时间, 不受主线程调度的影响
+        std::vector<Clock::time_point> begins(c.threads);
+        std::vector<Clock::time_point> ends(c.threads);
+        std::barrier start(static_cast<std::ptrdiff_t>(c.threads + 1));
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < c.threads; ++t) {
+            threads.emplace_back([&, t] {
+                auto& samples = latencies[t];
+                samples.resize(options.iterations);
+                // 预热: 对象池、线程缓存和文件
+                for (size_t i = 0; i < std::min<size_t>(options.iterations / 10, 1000); ++i) {
+                    call(i);
+                }
+                start.arrive_and_wait();
+                begins[t] = Clock::now();
+                for (size_t i = 0; i < options.iterations; ++i) {
+                    const auto begin = Clock::now();
+                    call(i);
+                    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count();
+                    samples[i] = static_cast<uint32_t>(std::min<int64_t>(ns, UINT32_MAX));
+                }
+                ends[t] = Clock::now();
+            });
+        }
+        // 等所有线程预热完一起开始
+        start.arrive_and_wait();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        const auto begin = *std::min_element(begins.begin(), begins.end());
+        const auto end = *std::max_element(ends.begin(), ends.end());
+        log::AsyncWorker::instance().stop();
+        const auto drained = Clock::now();
+        registry.clear();
+
+        Result result;
+        result.seconds = std::chrono::duration<double>(end - begin).count();
+        result.drainSeconds = std::chrono::duration<double>(drained - begin).count();
+        std::vector<uint32_t> all;
+        all.reserve(c.threads * options.iterations);
+        for (const auto& samples : latencies) {
+            all.insert(all.end(), samples.begin(), samples.end());
+        }
+        result.calls = all.size();
+        if (all.empty()) {
+            return result;
+        }
+        std::sort(all.begin(), all.end());
+        auto percentile = [&](double p) { return all[std::min(all.size() - 1, static_cast<size_t>(p * static_cast<double>(all.size())))]; };
+        result.p50 = percentile(0.5);
+        result.p90 = percentile(0.9);
+        result.p99 = percentile(0.99);
+        result.p999 = percentile(0.999);
+        result.max = all.back();
+        return result;
+    }
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if (!parse(argc, argv, options)) {
+        std::cerr << "usage: " << argv[0]
+                  << " [--threads=1,2,4] [--iterations=20000] [--appenders=null,file,console] [--sizes=16,128,1024]"
+                     " [--modes=sync,async] [--dir=bench_log] [--output=qlog_bench.jsonl]"
+                  << std::endl;
+        return 1;
+    }
+    std::ofstream output(options.output);
+    if (!output) {
+        std::cerr << "cannot open " << options.output << std::endl;
+        return 1;
+    }
+    // 只测日志本身
+    log::Metrics::setTiming(false);
+    std::cerr << std::format("{:<8} {:<6} {:>3} {:<8} {:<6} {:>5} {:>12} {:>8} {:>8} {:>8} {:>9}\n", "appender", "mode", "thr", "level",
+        "api", "size", "ops/s", "p50(ns)", "p99(ns)", "p999(ns)", "max(ns)");
+    for (const auto& appender : options.appenders) {
+        for (const auto& mode : options.modes) {
+            for (const size_t threads : options.threads) {
+                for (const bool filtered : {false, true}) {
+                    for (const bool printfApi : {true, false}) {
+                        for (const size_t size : options.sizes) {
+                            const Case c{appender, mode, threads, filtered, printfApi, size};
+                            const Result r = run(c, options);
+                            const double opsPerSecond = r.seconds > 0 ? static_cast<double>(r.calls) / r.seconds : 0;
+                            const double drainedPerSecond = r.drainSeconds > 0 ? static_cast<double>(r.calls) / r.drainSeconds : 0;
+                            output << std::format(
+                                "{{\"appender\":\"{}\",\"mode\":\"{}\",\"threads\":{},\"level\":\"{}\",\"api\":\"{}\",\"size\":{},\"calls\":{},"
+                                "\"seconds\":{:.6f},\"ops_per_sec\":{:.0f},\"drained_ops_per_sec\":{:.0f},"
+                                "\"p50_ns\":{},\"p90_ns\":{},\"p99_ns\":{},\"p999_ns\":{},\"max_ns\":{}}}\n",
+                                appender, mode, threads, filtered ? "filtered" : "emitted", printfApi ? "printf" : "stream", size, r.calls, r.seconds,
+                                opsPerSecond, drainedPerSecond, r.p50, r.p90, r.p99, r.p999, r.max);
+                            output.flush();
+                            std::cerr << std::format("{:<8} {:<6} {:>3} {:<8} {:<6} {:>5} {:>12.0f} {:>8} {:>8} {:>8} {:>9}\n", appender, mode,
+                                threads, filtered ? "filtered" : "emitted", printfApi ? "printf" : "stream", size, opsPerSecond, r.p50, r.p99,
+                                r.p999, r.max);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+﻿#include <iostream>
+#include "qlog.h"
+
+// 把BinaryFileAppender写的.qlb文件转成文本
+// 用法: qlog_decode <file.qlb> [...]
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <file.qlb> [...]" << std::endl;
+        return 1;
+    }
+    int result = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!ray::log::BinaryFileAppender::decode(argv[i], std::cout)) {
+            std::cerr << argv[i] << ": invalid or truncated binary log" << std::endl;
+            result = 1;
+        }
+    }
+    return result;
+}
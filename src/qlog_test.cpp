@@ -0,0 +1,157 @@
+﻿#include <algorithm>
+#include <iostream>
+#include <thread>
+#include "qlog.h"
+
+// qlog的单元测试, 不依赖测试框架, 有失败时返回非0。用ctest或者直接运行qlog_test。
+
+using namespace ray;
+
+namespace
+{
+    int failures = 0;
+
+#define CHECK(expr)                                                                     \
+    do {                                                                                \
+        if (!(expr)) {                                                                  \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #expr ") failed\n"; \
+            ++failures;                                                                 \
+        }                                                                               \
+    } while (0)
+
+    // 把格式化后的日志保存在共享的lines里, appender释放后还能检查
+    class CaptureAppender : public log::Appender
+    {
+    public:
+        explicit CaptureAppender(std::shared_ptr<std::vector<std::string>> lines)
+            : _lines(std::move(lines))
+        {
+            _level = log::Level::Debug;
+        }
+        ~CaptureAppender() { finishRepeats(); }
+        bool flush(const log::Event::Ptr event) override
+        {
+            _lines->push_back(render(event));
+            return true;
+        }
+
+    private:
+        std::shared_ptr<std::vector<std::string>> _lines;
+    };
+
+    // 注册名为name的CaptureAppender, 返回它写出的日志
+    std::shared_ptr<std::vector<std::string>> addCapture(const std::string& name)
+    {
+        auto lines = std::make_shared<std::vector<std::string>>();
+        log::AppenderFactory::instance().registerCreateMethod(name, [lines] { return std::make_shared<CaptureAppender>(lines); });
+        log::AppenderRegistry::instance().addAppenders({name});
+        return lines;
+    }
+
+    // 注册合并重复日志的CaptureAppender
+    std::shared_ptr<std::vector<std::string>> addCapture(const std::string& name, std::chrono::milliseconds timeout)
+    {
+        auto lines = addCapture(name);
+        log::AppenderRegistry::instance().get(name)->setCollapseDuplicates(true, timeout);
+        return lines;
+    }
+
+    size_t countSummary(const std::vector<std::string>& lines, const std::string& text)
+    {
+        return std::count_if(lines.begin(), lines.end(), [&](const std::string& line) { return line.find(text) != std::string::npos; });
+    }
+
+    void logRepeated(log::AppenderMask mask, int times)
+    {
+        for (int i = 0; i < times; ++i) {
+            log::Logger(__FILE__, __LINE__, log::Level::Info, mask) << "same message";
+        }
+    }
+
+    // 同步模式: 重复停了以后, 下一条写到其他appender的日志也会检查超时
+    void testCollapseSyncTimeout()
+    {
+        auto& registry = log::AppenderRegistry::instance();
+        auto lines = addCapture("collapse-sync", std::chrono::milliseconds(1));
+        addCapture("collapse-other", std::chrono::milliseconds(1));
+        logRepeated(registry.mask({"collapse-sync"}), 5);
+        CHECK(lines->size() == 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        log::Logger(__FILE__, __LINE__, log::Level::Info, registry.mask({"collapse-other"})) << "other";
+        CHECK(countSummary(*lines, "last message repeated 4 times") == 1);
+        registry.clear();
+    }
+
+    // 同步模式: 还没超时就退出, 析构时写出
+    void testCollapseSyncExit()
+    {
+        auto& registry = log::AppenderRegistry::instance();
+        auto lines = addCapture("collapse-exit", std::chrono::hours(1));
+        logRepeated(registry.mask({"collapse-exit"}), 5);
+        CHECK(countSummary(*lines, "last message repeated") == 0);
+        registry.clear();
+        CHECK(countSummary(*lines, "last message repeated 4 times") == 1);
+    }
+
+    // 异步模式: stop时还没超时的重复次数也要写出
+    void testCollapseAsyncStop()
+    {
+        auto& registry = log::AppenderRegistry::instance();
+        auto lines = addCapture("collapse-async", std::chrono::hours(1));
+        log::AsyncWorker::instance().start();
+        logRepeated(registry.mask({"collapse-async"}), 5);
+        log::AsyncWorker::instance().stop();
+        CHECK(countSummary(*lines, "last message repeated 4 times") == 1);
+        registry.clear();
+    }
+
+    void logFirstN(int times)
+    {
+        for (int i = 0; i < times; ++i) {
+            QLOG_FIRST_N(log::Level::Info, 3) << "first " << i;
+        }
+    }
+
+    // 同步模式: FIRST_N超过次数后的调用由后面的日志单独写一条数量
+    void testFirstNSync()
+    {
+        auto& registry = log::AppenderRegistry::instance();
+        // 宏写到DEFAULT_APPENDERS, 用console的名字注册
+        auto lines = addCapture("console");
+        logFirstN(10);
+        CHECK(lines->size() == 3);
+        log::Logger(__FILE__, __LINE__, log::Level::Info) << "other";
+        CHECK(countSummary(*lines, "suppressed 7 messages") == 1);
+        registry.clear();
+    }
+
+    // 异步模式: stop时写出丢弃数量
+    void testFirstNAsyncStop()
+    {
+        auto& registry = log::AppenderRegistry::instance();
+        auto lines = addCapture("console");
+        log::AsyncWorker::instance().start();
+        logFirstN(10);
+        log::AsyncWorker::instance().stop();
+        // 和同步的用例是同一个调用位置, 已经超过次数了
+        CHECK(lines->size() == 1);
+        CHECK(countSummary(*lines, "suppressed 10 messages") == 1);
+        registry.clear();
+    }
+} // namespace
+
+int main()
+{
+    // 丢弃数量的报告每秒最多一次, 同步的用例要在后台线程运行之前
+    testFirstNSync();
+    testFirstNAsyncStop();
+    testCollapseSyncTimeout();
+    testCollapseSyncExit();
+    testCollapseAsyncStop();
+    if (failures) {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "all tests passed\n";
+    return 0;
+}